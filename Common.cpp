@@ -23,6 +23,12 @@
 #include "Common.h"
 #include "simplexnoise1234.h"
 
+/* Largest gradient length of 3D simplex noise. Measured maximum is about 8.8,
+ * rounded up for safety. */
+#define SIMPLEX_GRADIENT_BOUND 10.0f
+// Samples per rectangle edge in heightNoiseBounds
+#define BOUND_SAMPLES 3
+
 
 Ogre::Vector3 convertSphericalToCartesian (Ogre::Real latitude, Ogre::Real longitude)   {
 	Ogre::Vector3 sphereCoord;
@@ -79,6 +85,29 @@ Ogre::Vector2 convertCartesianToPlateCarree(Ogre::Vector3 position) {
 	return Ogre::Vector2(u, v);
 }
 
+void encodeOctahedronNormal(const Ogre::Vector3 &normal,
+                            Ogre::int16 &u, Ogre::int16 &v)
+{
+    Ogre::Real x, y, l1Norm, tmp;
+
+    // Project to octahedron |x|+|y|+|z| = 1
+    l1Norm = Ogre::Math::Abs(normal.x) + Ogre::Math::Abs(normal.y)
+             + Ogre::Math::Abs(normal.z);
+    x = normal.x / l1Norm;
+    y = normal.y / l1Norm;
+
+    // Fold lower hemisphere over the diagonals
+    if (normal.z < 0.0f)
+    {
+        tmp = x;
+        x = (1.0f - Ogre::Math::Abs(y)) * (tmp >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - Ogre::Math::Abs(tmp)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    u = static_cast<Ogre::int16>(Ogre::Math::Floor(x*32767.0f + 0.5f));
+    v = static_cast<Ogre::int16>(Ogre::Math::Floor(y*32767.0f + 0.5f));
+}
+
 Ogre::Real heightNoise(std::vector<float> &amplitude,
                        std::vector<float> &frequency, Ogre::Vector3 Point)
 {
@@ -96,6 +125,76 @@ Ogre::Real heightNoise(std::vector<float> &amplitude,
     return height;
 }
 
+Ogre::Real heightNoiseLipschitz(std::vector<float> &amplitude,
+                                std::vector<float> &frequency)
+{
+    Ogre::uint32 i;
+    Ogre::Real bound = 0.0f;
+
+    for(i=0; i < amplitude.size(); i++)
+        bound += Ogre::Math::Abs(amplitude[i]) * SIMPLEX_GRADIENT_BOUND / frequency[i];
+
+    return bound;
+}
+
+void heightNoiseBounds(std::vector<float> &amplitude,
+                       std::vector<float> &frequency,
+                       const Ogre::Vector3 &translate, const Ogre::Matrix3 &face,
+                       Grid::CubeMapping mapping,
+                       Ogre::Vector2 upperLeft, Ogre::Vector2 lowerRight,
+                       Ogre::Real &low, Ogre::Real &high)
+{
+    Ogre::Vector3 samples[BOUND_SAMPLES*BOUND_SAMPLES], pos;
+    Ogre::Vector2 step;
+    Ogre::Real reach, range, margin, value, octaveLow, octaveHigh;
+    Ogre::uint32 i, j;
+
+    /* Any point of the rectangle is at most half a cell diagonal from a
+     * sample. Distance on the unit sphere is never longer than in face
+     * coordinates, with either mapping. */
+    step = (lowerRight - upperLeft)/(BOUND_SAMPLES-1);
+    for(j=0; j < BOUND_SAMPLES; j++)
+    {
+        for(i=0; i < BOUND_SAMPLES; i++)
+        {
+            pos = Grid::faceToSphere(mapping, face, Ogre::Vector2(upperLeft.x + i*step.x,
+                                                                  upperLeft.y + j*step.y));
+            samples[j*BOUND_SAMPLES+i] = pos + translate;
+        }
+    }
+    reach = step.length()/2.0f;
+
+    low = 0.0f;
+    high = 0.0f;
+    for(i=0; i < amplitude.size(); i++)
+    {
+        range = Ogre::Math::Abs(amplitude[i]);
+        margin = range * SIMPLEX_GRADIENT_BOUND / frequency[i] * reach;
+
+        // Octave can go through its whole range between samples
+        if (margin >= 2.0f*range)
+        {
+            low -= range;
+            high += range;
+            continue;
+        }
+
+        octaveLow = range;
+        octaveHigh = -range;
+        for(j=0; j < BOUND_SAMPLES*BOUND_SAMPLES; j++)
+        {
+            value = amplitude[i] * SimplexNoise1234::noise(samples[j].x/frequency[i],
+                                                           samples[j].y/frequency[i],
+                                                           samples[j].z/frequency[i]);
+            octaveLow = std::min(octaveLow, value);
+            octaveHigh = std::max(octaveHigh, value);
+        }
+
+        low += std::max(octaveLow - margin, -range);
+        high += std::min(octaveHigh + margin, range);
+    }
+}
+
 Ogre::ColourValue generatePixel(Ogre::Real height,
                                 Ogre::Real seaHeight,
                                 Ogre::Real minimumHeight,
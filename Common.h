@@ -24,15 +24,37 @@
 #define COMMON_H
 
 #include <Ogre.h>
+#include "Grid.h"
 
 
 Ogre::Vector3 convertSphericalToCartesian (Ogre::Real latitude, Ogre::Real longitude);
 
 Ogre::Vector2 convertCartesianToPlateCarree(Ogre::Vector3 position);
 
+/* Encodes unit vector as two octahedron-mapped components, both scaled to
+ * range -32767 - +32767 */
+void encodeOctahedronNormal(const Ogre::Vector3 &normal,
+                            Ogre::int16 &u, Ogre::int16 &v);
+
 Ogre::Real heightNoise(std::vector<float> &amplitude,
                        std::vector<float> &frequency, Ogre::Vector3 Point);
 
+/* Upper bound for how fast heightNoise can change: |h(a)-h(b)| <= L*|a-b| */
+Ogre::Real heightNoiseLipschitz(std::vector<float> &amplitude,
+                                std::vector<float> &frequency);
+
+/* Conservative range of heightNoise over a cube face rectangle projected to
+ * the unit sphere with mapping, face oriented and translated like tile
+ * rasters. Every
+ * octave is sampled at a few points and widened by its own Lipschitz bound,
+ * so the range gets tighter as the rectangle gets smaller. */
+void heightNoiseBounds(std::vector<float> &amplitude,
+                       std::vector<float> &frequency,
+                       const Ogre::Vector3 &translate, const Ogre::Matrix3 &face,
+                       Grid::CubeMapping mapping,
+                       Ogre::Vector2 upperLeft, Ogre::Vector2 lowerRight,
+                       Ogre::Real &low, Ogre::Real &high);
+
 Ogre::ColourValue generatePixel(Ogre::Real height,
                                 Ogre::Real seaHeight,
                                 Ogre::Real minimumHeight,
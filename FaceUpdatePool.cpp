@@ -0,0 +1,109 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include "FaceUpdatePool.h"
+#include "PquadTree.h"
+
+FaceUpdatePool::FaceUpdatePool(const std::vector<PquadTree*> &faces)
+{
+    this->faces = faces;
+    this->generation = 0;
+    this->pending = 0;
+    this->changed = false;
+    this->stopping = false;
+    this->frustum = NULL;
+
+    for(unsigned int i=1; i < faces.size(); i++)
+        threads.push_back(std::thread(&FaceUpdatePool::workerLoop, this, i));
+}
+
+FaceUpdatePool::~FaceUpdatePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(updateMutex);
+        stopping = true;
+    }
+    startSignal.notify_all();
+
+    for(unsigned int i=0; i < threads.size(); i++)
+    {
+        if (threads[i].joinable())
+            threads[i].join();
+    }
+}
+
+bool FaceUpdatePool::update(Ogre::Vector3 viewer, const std::vector<Ogre::Plane> &frustum)
+{
+    bool firstChanged;
+
+    {
+        std::lock_guard<std::mutex> lock(updateMutex);
+        this->viewer = viewer;
+        this->frustum = &frustum;
+        this->changed = false;
+        this->pending = threads.size();
+        this->generation++;
+    }
+    startSignal.notify_all();
+
+    firstChanged = faces[0]->update(viewer, frustum);
+
+    std::unique_lock<std::mutex> lock(updateMutex);
+    while (pending > 0)
+        doneSignal.wait(lock);
+
+    return firstChanged || changed;
+}
+
+void FaceUpdatePool::workerLoop(unsigned int face)
+{
+    Ogre::uint64 done = 0;
+    Ogre::Vector3 viewer;
+    const std::vector<Ogre::Plane> *frustum;
+    bool faceChanged;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(updateMutex);
+            while (generation == done && !stopping)
+                startSignal.wait(lock);
+
+            if (stopping)
+                return;
+
+            done = generation;
+            viewer = this->viewer;
+            frustum = this->frustum;
+        }
+
+        faceChanged = faces[face]->update(viewer, *frustum);
+
+        {
+            std::lock_guard<std::mutex> lock(updateMutex);
+            if (faceChanged)
+                changed = true;
+            pending--;
+        }
+        doneSignal.notify_one();
+    }
+}
@@ -0,0 +1,65 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef FACEUPDATEPOOL_H
+#define FACEUPDATEPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <OgrePrerequisites.h>
+#include <OgrePlane.h>
+#include <OgreVector3.h>
+
+class PquadTree;
+
+/* Threads that update cube faces in parallel, one per face but the first,
+ * which the calling thread updates itself. Threads live as long as the
+ * pool, so a frame only wakes them up instead of starting new ones. */
+class FaceUpdatePool
+{
+public:
+    FaceUpdatePool(const std::vector<PquadTree*> &faces);
+    ~FaceUpdatePool();
+
+    /* Runs PquadTree::update on every face and waits for all of them.
+     * Returns true if any face changed. */
+    bool update(Ogre::Vector3 viewer, const std::vector<Ogre::Plane> &frustum);
+private:
+    std::vector<PquadTree*>     faces;
+    std::vector<std::thread>    threads;
+    std::mutex                  updateMutex;
+    std::condition_variable     startSignal;
+    std::condition_variable     doneSignal;
+    // Bumped for every update, threads run once per value
+    Ogre::uint64                generation;
+    Ogre::uint32                pending;
+    bool                        changed;
+    bool                        stopping;
+    Ogre::Vector3               viewer;
+    const std::vector<Ogre::Plane> *frustum;
+
+    void workerLoop(unsigned int face);
+};
+
+#endif // FACEUPDATEPOOL_H
@@ -30,7 +30,7 @@ GeneratorFrameListener::GeneratorFrameListener(	Ogre::RenderWindow* win, Ogre::C
 												CollisionManager	*CDM ,bool bufferedKeys, bool bufferedMouse,
 												bool bufferedJoy) :
 	mCamera(cam), mTranslateVector(Ogre::Vector3::ZERO), mCurrentSpeed(0), mWindow(win), mStatsOn(true), mNumScreenShots(0),
-	mMoveScale(0.0f), mRotScale(0.0f), mTimeUntilNextToggle(0), mFiltering(Ogre::TFO_BILINEAR),
+	mMoveScale(0.0f), mFrameTime(0.0f), mRotScale(0.0f), mTimeUntilNextToggle(0), mFiltering(Ogre::TFO_BILINEAR),
 	mAniso(1), mSceneDetailIndex(0), mMoveSpeed(100), mRotateSpeed(18), mDebugOverlay(0),
 	mInputManager(0), mMouse(0), mKeyboard(0), mJoy(0)
 {
@@ -466,7 +466,10 @@ void GeneratorFrameListener::moveCamera()
 	mCamera->pitch(mRotY);
 	Ogre::Vector3 oldPosition=mCamera->getPosition();
 	mCamera->moveRelative(mTranslateVector);
-	pSphere->setObserverPosition(mCamera->getPosition());
+	if (mFrameTime > 0.0f)
+		pSphere->setObserverVelocity((mCamera->getPosition() - oldPosition)/mFrameTime);
+	pSphere->setProjection(mCamera->getViewport()->getActualHeight(), mCamera->getFOVy());
+	pSphere->setObserverPosition(mCamera->getPosition(), mCamera);
 
 	if( pSphere->getObserverDistanceToSurface()<=2.0f)// inside the sphere
 	{
@@ -511,6 +514,7 @@ bool GeneratorFrameListener::frameRenderingQueued(const Ogre::FrameEvent& evt)
 	if(mWindow->isClosed())	return false;
 
 	mSpeedLimit = mMoveScale * evt.timeSinceLastFrame;
+	mFrameTime = evt.timeSinceLastFrame;
 
 	//Need to capture/update each device
 	mKeyboard->capture();
@@ -184,6 +184,8 @@ protected:
 	unsigned int		mNumScreenShots;
 	float				mMoveScale;
 	float				mSpeedLimit;
+	// Seconds since last frame, for observer velocity
+	float				mFrameTime;
 	Ogre::Degree		mRotScale;
 	// just to stop toggles flipping too fast
 	Ogre::Real			mTimeUntilNextToggle ;
@@ -20,9 +20,13 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE. */
 
+#include <cmath>
 #include "Grid.h"
 #include "Common.h"
 
+// Face edge is this far from face centre, as seen from sphere centre
+#define QUARTER_PI 0.78539816339744830962
+
 Grid::Grid(unsigned int size, const Ogre::Matrix3 face,
            Ogre::Vector2 UpperLeft, Ogre::Vector2 LowerRight)
 {
@@ -33,6 +37,7 @@ Grid::Grid(unsigned int size, const Ogre::Matrix3 face,
 	orientation = face;
     this->UpperLeft = UpperLeft;
     this->LowerRight = LowerRight;
+    this->mapping = MAPPING_GNOMONIC;
 
 	xplusNeighbour = NULL;
 	xminusNeighbour = NULL;
@@ -79,18 +84,50 @@ Ogre::Vector3 Grid::projectToSphere(unsigned int x, unsigned int y)
     subtracted = this->LowerRight - this->UpperLeft;
     posTemp = this->UpperLeft + xyPos*subtracted;
 
+	return faceToSphere(this->mapping, this->orientation, posTemp);
+}
+
+void Grid::setMapping(CubeMapping mapping)
+{
+    this->mapping = mapping;
+}
+
+Grid::CubeMapping Grid::getMapping()
+{
+    return this->mapping;
+}
+
+double Grid::warp(CubeMapping mapping, double faceCoord)
+{
+    if (mapping == MAPPING_TANGENT)
+        return std::tan(faceCoord*QUARTER_PI);
+    return faceCoord;
+}
+
+double Grid::unwarp(CubeMapping mapping, double planeCoord)
+{
+    if (mapping == MAPPING_TANGENT)
+        return std::atan(planeCoord)/QUARTER_PI;
+    return planeCoord;
+}
+
+Ogre::Vector3 Grid::faceToSphere(CubeMapping mapping, const Ogre::Matrix3 &face,
+                                 Ogre::Vector2 facePoint)
+{
+    Ogre::Vector3 pos;
+
     /* For convenience treat xy-grid as a xz-plane in sphere-coordinates which
      * means that rotating with identity matrix, normal of a grid-plane points
      * toward +y. */
-    pos.x = posTemp.x;
-    pos.z = posTemp.y;
-	pos.y = 1.0f;
+    pos.x = warp(mapping, facePoint.x);
+    pos.z = warp(mapping, facePoint.y);
+    pos.y = 1.0f;
     // reorientate
-	pos = orientation*pos;
+    pos = face*pos;
     // project grid to unit sphere
-	pos.normalise();
+    pos.normalise();
 
-	return pos;
+    return pos;
 }
 
 /* Function to set neighboring HeightMaps */
@@ -32,6 +32,14 @@ class Grid
 public:
 	enum Grid_neighbour {neighbour_XP, neighbour_XM, neighbour_YP, neighbour_YM};
 
+    /* How face coordinates, -1 - +1 over a cube face, map to the sphere.
+     * Gnomonic projects the face plane straight to the sphere, and corner
+     * cells end up about 5 times smaller than centre cells. Tangent warps
+     * face coordinates through tan first, which keeps cell area within a
+     * factor of 1.5, so the same detail needs fewer vertices. Both keep
+     * lines of constant face coordinate on great circles. */
+    enum CubeMapping {MAPPING_GNOMONIC, MAPPING_TANGENT};
+
     Grid(unsigned int size, const Ogre::Matrix3 face,
          Ogre::Vector2 UpperLeft, Ogre::Vector2 LowerRight);
 	~Grid();
@@ -40,6 +48,21 @@ public:
 	void setValue(unsigned int x, unsigned int y, int val);
 	int getValue(unsigned int x, unsigned int y);
 	Ogre::Vector3 projectToSphere(unsigned int x, unsigned int y);
+
+    /* Mapping used by projectToSphere, gnomonic unless set */
+    void setMapping(CubeMapping mapping);
+    CubeMapping getMapping();
+
+    /* Coordinate on the face plane at unit distance for a face coordinate,
+     * and back. Face coordinates past -1 - +1 reach over the face edge.
+     * Tangent mapping diverges at 2, so they have to stay well below it;
+     * callers go at most half a root tile over, to 1.5. */
+    static double warp(CubeMapping mapping, double faceCoord);
+    static double unwarp(CubeMapping mapping, double planeCoord);
+
+    /* Unit sphere point of a face point, rotated by face orientation */
+    static Ogre::Vector3 faceToSphere(CubeMapping mapping, const Ogre::Matrix3 &face,
+                                      Ogre::Vector2 facePoint);
 	void setNeighbours(Grid *xPlus, Grid *xMinus, Grid *yPlus, Grid *yMinus);
 	Grid *getNeighbourPtr(Grid_neighbour neighbour);
 	bool getNeighbourEntryCoordinates(Grid_neighbour neighbour, unsigned int &entry_x, unsigned int &entry_y);
@@ -49,6 +72,7 @@ protected:
 	Ogre::Matrix3	orientation;
     Ogre::Vector2   UpperLeft;
     Ogre::Vector2   LowerRight;
+    CubeMapping     mapping;
 	Grid		*xplusNeighbour;
 	Grid		*xminusNeighbour;
 	Grid		*yplusNeighbour;
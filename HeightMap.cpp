@@ -21,15 +21,29 @@
  * THE SOFTWARE. */
 
 #include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <OgrePlatformInformation.h>
+#if __OGRE_HAVE_SSE
+#include <xmmintrin.h>
+#endif
 #include "HeightMap.h"
+#include "TileBatcher.h"
+#include "TileResourcePool.h"
 #include "Common.h"
 
 HeightMap::HeightMap(unsigned int size,
+                     Ogre::uint16 textureSize,
                      const Ogre::Matrix3 face,
                      Ogre::Vector2 UpperLeft,
                      Ogre::Vector2 LowerRight,
                      ResourceParameter *param,
-                     Ogre::Real Height_sea)
+                     Ogre::Real Height_sea,
+                     TileIndexPatterns *patterns,
+                     TileIndexPatterns *oceanPatterns,
+                     bool compactVertices)
     /* Resize by 2 iterations per dimension to include flange */
     : Grid(size+2, face,
            UpperLeft+Ogre::Vector2(-(LowerRight.x-UpperLeft.x),
@@ -44,16 +58,39 @@ HeightMap::HeightMap(unsigned int size,
 
     Ogre::Real maxAmplitude=0;
 
-    child[0] = NULL;
-    child[1] = NULL;
-    child[2] = NULL;
-    child[3] = NULL;
+    this->buildState = BUILD_EMPTY;
+    this->cancelled.store(false);
 
     RParam = param;
     seaHeight = Height_sea;
-    textureResolution = 128;
-    this->entity = NULL;
+
+    /* Texture is a height raster aligned with the geometry lattice, so its
+     * resolution is rounded down to a whole multiple of lattice intervals.
+     * Noise is then sampled no more often than the texture asks for. */
+    textureResolution = rasterResolution(size, textureSize);
+    rasterStride = (textureResolution-1) / (gridSize-1);
+    this->resources = NULL;
+    this->pool = NULL;
     this->height = NULL;
+    this->compactVertices = compactVertices;
+    this->tileNode = NULL;
+    this->attachedNode = NULL;
+    this->tileScale = 1.0f;
+    this->tileOrigin = Ogre::Vector3::ZERO;
+    this->patterns = patterns;
+    this->oceanPatterns = oceanPatterns;
+    this->stitchMask = 0;
+    this->ocean = false;
+    this->squareTexture = NULL;
+    this->normalMap = NULL;
+    this->normalMapped = false;
+    this->standIn = NULL;
+    this->batcher = NULL;
+    this->batched = false;
+    this->geometricError = 0.0f;
+    this->diskCache = NULL;
+
+    assert(patterns->getSize() == size);
 
     /* Calculate minimum and maximum possible height assuming noise
      * range between -1 - +1 */
@@ -65,11 +102,20 @@ HeightMap::HeightMap(unsigned int size,
     minHeight = -maxAmplitude;
     maxHeight = +maxAmplitude;
 
+    // Geometry never goes below sea level
+    boundMin = std::max(minHeight, seaHeight);
+    boundMax = std::max(maxHeight, seaHeight);
+
     RParam->getRandomTranslate(randomTranslate.x, randomTranslate.y, randomTranslate.z);
 }
 
 HeightMap::~HeightMap()
 {
+    // Owner drops the stand-in before, it has hardware buffers
+    assert(this->standIn == NULL);
+    // Batch would keep pointing to the tile
+    assert(!this->batched);
+
     if (this->height != NULL)
     {
         free2DArray(height);
@@ -77,14 +123,22 @@ HeightMap::~HeightMap()
         delete[] vertexes;
         delete[] verNorms;
         delete[] txCoords;
-        delete[] indexes;
         delete[] squareTexture;
+        delete[] normalMap;
     }
 }
 
-void HeightMap::setHeight(unsigned int x, unsigned int y, float elevation)
+Ogre::uint16 HeightMap::rasterResolution(Ogre::uint32 size, Ogre::uint16 textureSize)
+{
+    Ogre::uint32 gSize = size+2;
+    Ogre::uint32 stride = std::max<Ogre::uint32>(1, (textureSize-1) / (gSize-1));
+
+    return stride*(gSize-1) + 1;
+}
+
+float HeightMap::getHeight(unsigned int x, unsigned int y)
 {
-	height[y][x] = elevation;
+    return height[y*rasterStride][x*rasterStride];
 }
 
 /* Return vector for a normalized (radius 1.0) sphere */
@@ -100,170 +154,224 @@ Ogre::Vector3 HeightMap::projectToSphere(unsigned int x, unsigned int y,
 	return pos;
 }
 
+void HeightMap::latticeToSphere(double x, double y, double position[3])
+{
+    double tileSize, faceX, faceY, length;
+
+    /* Face coordinates from the key, float tile corners run out of bits
+     * at deep levels. Lattice point 1 is the tile corner, 0 is flange. */
+    tileSize = 2.0/static_cast<double>(1u << this->key.getLevel());
+    faceX = -1.0 + (this->key.getX() + (x-1.0)/(cornerGSize-1))*tileSize;
+    faceY = 1.0 - (this->key.getY() + (y-1.0)/(cornerGSize-1))*tileSize;
+    faceX = warp(this->mapping, faceX);
+    faceY = warp(this->mapping, faceY);
+
+    // Face as the xz-plane at y=1, like Grid::faceToSphere
+    for(int i=0; i < 3; i++)
+        position[i] = orientation[i][0]*faceX + orientation[i][1] + orientation[i][2]*faceY;
+
+    length = std::sqrt(position[0]*position[0] + position[1]*position[1]
+                       + position[2]*position[2]);
+    for(int i=0; i < 3; i++)
+        position[i] /= length;
+}
+
 // scalingFactor scales size of the mesh
 void HeightMap::generateMeshData(float scalingFactor)
 {
-    unsigned int x, y, idx;
+    unsigned int x, y, idx, gSize = this->gridSize;
+    std::vector<double> position(gSize*gSize*3);
+    double boxMin[3], boxMax[3], origin[3], radius, *p;
 
 	idx = 0;
-	for(x=0; x < gridSize; x++)
+	for(x=0; x < gSize; x++)
 	{
-		for(y=0; y < gridSize; y++)
+		for(y=0; y < gSize; y++)
 		{
-			// Project height-map location to a sphere
-            vertexes[idx] = projectToSphere(x, y, height[y][x]) * scalingFactor;
-
-            // Flatten vertices that are under sea-level
-            if (vertexes[idx].length() < (1.0f+seaHeight)*scalingFactor)
-            {
-                vertexes[idx].normalise();
-                vertexes[idx] = (vertexes[idx] + seaHeight)*scalingFactor;
-            }
-
-			// Calculate texture-coordinate for the vertex
-            txCoords[idx].x = static_cast<float>(x)/static_cast<float>(gridSize-1);
-            txCoords[idx].y = static_cast<float>(y)/static_cast<float>(gridSize-1);
+            // Vertices under sea-level are flattened to it
+            p = &position[idx*3];
+            latticeToSphere(x, y, p);
+            radius = (1.0 + std::max(getHeight(x, y), seaHeight))*scalingFactor;
+            for(int i=0; i < 3; i++)
+                p[i] *= radius;
+
+            /* Calculate texture-coordinate for the vertex. Points to the
+             * centre of the texel sampled at the same location. */
+            txCoords[idx].x = (static_cast<float>(x*rasterStride)+0.5f)
+                              / static_cast<float>(textureResolution);
+            txCoords[idx].y = (static_cast<float>(y*rasterStride)+0.5f)
+                              / static_cast<float>(textureResolution);
 			idx++;
 		}
 	}
 
-	// Create indexes to build triangles.
-	idx = 0;
-	for(x=0; x < gridSize-1; x++)
-	{
-		for(y=0; y < gridSize-1; y++)
-		{
-			// Triangle 1
-			indexes[idx] = x*gridSize+y+gridSize+1;
-			idx++;
-			indexes[idx] = x*gridSize+y;
-			idx++;
-			indexes[idx] = x*gridSize+y+gridSize;
-			idx++;
+    /* Origin is the centre of inner vertices, rounded to float so that the
+     * node transform puts vertices back exactly */
+    for(int i=0; i < 3; i++)
+    {
+        boxMin[i] = position[(gSize+1)*3+i];
+        boxMax[i] = boxMin[i];
+    }
+    for(x=1; x < gSize-1; x++)
+    {
+        for(y=1; y < gSize-1; y++)
+        {
+            p = &position[(x*gSize+y)*3];
+            for(int i=0; i < 3; i++)
+            {
+                boxMin[i] = std::min(boxMin[i], p[i]);
+                boxMax[i] = std::max(boxMax[i], p[i]);
+            }
+        }
+    }
+    this->tileOrigin = Ogre::Vector3((boxMin[0]+boxMax[0])/2.0, (boxMin[1]+boxMax[1])/2.0,
+                                     (boxMin[2]+boxMax[2])/2.0);
+    origin[0] = this->tileOrigin.x;
+    origin[1] = this->tileOrigin.y;
+    origin[2] = this->tileOrigin.z;
 
-			// Triangle 2, in other words, a quad.
-			indexes[idx] = x*gridSize+y;
-			idx++;
-			indexes[idx] = x*gridSize+y+gridSize+1;
-			idx++;
-			indexes[idx] = x*gridSize+y+1;
-			idx++;
-		}
-	}
+    for(idx=0; idx < gSize*gSize; idx++)
+    {
+        p = &position[idx*3];
+        vertexes[idx] = Ogre::Vector3(p[0]-origin[0], p[1]-origin[1], p[2]-origin[2]);
+    }
 
 	// Generate normals
 	calculateNormals();
-
-    foldSkirts(scalingFactor);
 }
 
 void HeightMap::calculateNormals()
 {
-	Ogre::uint32 i, indexCount;
-	Ogre::Vector3 p1, p2, normal;
+    Ogre::uint32 x, y, xm, xp, gSize = this->gridSize;
+    float *posX, *posY, *posZ;
+
+    /* Separate x, y and z lattices, so that four neighbouring vertices can
+     * be loaded at once. */
+    posX = new float[gSize*gSize];
+    posY = new float[gSize*gSize];
+    posZ = new float[gSize*gSize];
+    for(x=0; x < gSize*gSize; x++)
+    {
+        posX[x] = vertexes[x].x;
+        posY[x] = vertexes[x].y;
+        posZ[x] = vertexes[x].z;
+    }
 
-	// Blended normals for a vertex
-	// first, zero our normals, so that we can use it as a accumulator
-	for(i=0; i < gridSize*gridSize; i++)
-	{
-		verNorms[i].x = 0.0f;
-		verNorms[i].y = 0.0f;
-		verNorms[i].z = 0.0f;
-	}
-	/* calculate normals for every triangle. Multiple normals are added together
-	 * for each vertex, so result is average of all the normals. */
-	indexCount = (gridSize-1)*(gridSize-1)*6;
-	for(i=0; i < indexCount; i = i + 3)
-	{
-		p1 = vertexes[indexes[i]] - vertexes[indexes[i+1]];
-		p2 = vertexes[indexes[i+1]] - vertexes[indexes[i+2]];
-		normal = p1.crossProduct(p2);
+    for(x=0; x < gSize; x++)
+    {
+        // Flange rows have neighbours only on one side
+        if (x == 0 || x == gSize-1)
+        {
+            for(y=0; y < gSize; y++)
+                verNorms[x*gSize+y] = latticeNormal(posX, posY, posZ, x, y);
+            continue;
+        }
 
-		verNorms[indexes[i]] += normal;
-		verNorms[indexes[i+1]] += normal;
-		verNorms[indexes[i+2]] += normal;
-	}
-	// Normalization pass
-	for(i=0; i < gridSize*gridSize; i++)
-	{
-		verNorms[i].normalise();
-	}
-}
+        xm = (x-1)*gSize;
+        xp = (x+1)*gSize;
 
-void HeightMap::foldSkirts(float scaling)
-{
-    Ogre::uint32 x=0, y=0, gSize;
-    Ogre::Real xProj, yProj;
+        verNorms[x*gSize] = latticeNormal(posX, posY, posZ, x, 0);
+        y = 1;
 
-    gSize = this->gridSize;
-    for(x=0; x < gSize; x++)
-    {
-        y=0;
-        xProj = x;
-        if (x==0)
-            xProj = x+1;
-        else if (x==gSize-1)
-            xProj = x-1;
+#if __OGRE_HAVE_SSE
+        __m128 dXx, dXy, dXz, dYx, dYy, dYz, nx, ny, nz, len;
+        float outX[4], outY[4], outZ[4];
+        const __m128 tiny = _mm_set1_ps(1e-20f);
 
-        /* Cases x=first and x=last */
-        if ( (x==0) || (x == gSize-1) )
+        for(; y+4 < gSize; y += 4)
         {
-            for(y=1; y < gSize-1; y++)
-            {
-                yProj = y;
-                vertexes[x*gSize+y] = projectToSphere(xProj, yProj, this->minHeight) * scaling;
-            }
+            /* Difference across the row and along the row */
+            dXx = _mm_sub_ps(_mm_loadu_ps(posX+xp+y), _mm_loadu_ps(posX+xm+y));
+            dXy = _mm_sub_ps(_mm_loadu_ps(posY+xp+y), _mm_loadu_ps(posY+xm+y));
+            dXz = _mm_sub_ps(_mm_loadu_ps(posZ+xp+y), _mm_loadu_ps(posZ+xm+y));
+            dYx = _mm_sub_ps(_mm_loadu_ps(posX+x*gSize+y+1), _mm_loadu_ps(posX+x*gSize+y-1));
+            dYy = _mm_sub_ps(_mm_loadu_ps(posY+x*gSize+y+1), _mm_loadu_ps(posY+x*gSize+y-1));
+            dYz = _mm_sub_ps(_mm_loadu_ps(posZ+x*gSize+y+1), _mm_loadu_ps(posZ+x*gSize+y-1));
+
+            // Cross product dX x dY
+            nx = _mm_sub_ps(_mm_mul_ps(dXy, dYz), _mm_mul_ps(dXz, dYy));
+            ny = _mm_sub_ps(_mm_mul_ps(dXz, dYx), _mm_mul_ps(dXx, dYz));
+            nz = _mm_sub_ps(_mm_mul_ps(dXx, dYy), _mm_mul_ps(dXy, dYx));
+
+            len = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)),
+                             _mm_mul_ps(nz, nz));
+            len = _mm_sqrt_ps(_mm_max_ps(len, tiny));
+
+            _mm_storeu_ps(outX, _mm_div_ps(nx, len));
+            _mm_storeu_ps(outY, _mm_div_ps(ny, len));
+            _mm_storeu_ps(outZ, _mm_div_ps(nz, len));
+
+            for(int i=0; i < 4; i++)
+                verNorms[x*gSize+y+i] = Ogre::Vector3(outX[i], outY[i], outZ[i]);
         }
-        /* vertexes y=first and y=last */
-        vertexes[x*gSize+0] = projectToSphere(xProj, 1, this->minHeight) * scaling;
-        vertexes[x*gSize+gSize-1] = projectToSphere(xProj, gSize-2, this->minHeight) * scaling;
+#endif
+        // Rest of the row, including the flange
+        for(; y < gSize; y++)
+            verNorms[x*gSize+y] = latticeNormal(posX, posY, posZ, x, y);
     }
+
+    delete[] posX;
+    delete[] posY;
+    delete[] posZ;
+}
+
+Ogre::Vector3 HeightMap::latticeNormal(const float *posX, const float *posY, const float *posZ,
+                                       Ogre::uint32 x, Ogre::uint32 y)
+{
+    Ogre::uint32 xm, xp, ym, yp, gSize = this->gridSize;
+    Ogre::Vector3 dX, dY, normal;
+
+    xm = x > 0 ? x-1 : x;
+    xp = x < gSize-1 ? x+1 : x;
+    ym = y > 0 ? y-1 : y;
+    yp = y < gSize-1 ? y+1 : y;
+
+    dX = Ogre::Vector3(posX[xp*gSize+y] - posX[xm*gSize+y],
+                       posY[xp*gSize+y] - posY[xm*gSize+y],
+                       posZ[xp*gSize+y] - posZ[xm*gSize+y]);
+    dY = Ogre::Vector3(posX[x*gSize+yp] - posX[x*gSize+ym],
+                       posY[x*gSize+yp] - posY[x*gSize+ym],
+                       posZ[x*gSize+yp] - posZ[x*gSize+ym]);
+
+    // Same winding as triangles, so normal points away from planet centre
+    normal = dX.crossProduct(dY);
+    normal.normalise();
+
+    return normal;
 }
 
-void HeightMap::createGeometry()
+void HeightMap::createHeightRaster()
 {
-    Ogre::uint16 x, y, gSize;
-    Ogre::Real elev;
+    Ogre::uint32 x, y, gSize = this->textureResolution;
+    double position[3];
     Ogre::Vector3 spherePos;
 
-    gSize = this->gridSize;
+    /* Raster spans the same area as the geometry lattice, including flange.
+     * Points come from the key in double, like the vertices. */
     for(y=0; y < gSize; y++)
     {
         for(x=0; x < gSize; x++)
         {
             /* SpherePos is a point on a smooth sphere */
-            spherePos = Grid::projectToSphere(x, y);
-            elev = heightNoise(RParam->getAmplitude(), RParam->getFrequency(),
-                               spherePos+this->randomTranslate);
-            this->setHeight(x, y, elev);
+            latticeToSphere(static_cast<double>(x)/rasterStride,
+                            static_cast<double>(y)/rasterStride, position);
+            spherePos = Ogre::Vector3(position[0], position[1], position[2]);
+            height[y][x] = heightNoise(RParam->getAmplitude(),
+                                       RParam->getFrequency(),
+                                       spherePos+this->randomTranslate);
         }
     }
 }
 
 void HeightMap::createTexture()
 {
-    Grid *tGrid;
     Ogre::uint16 gSize, x, y;
     unsigned char red, green, blue;
-    Ogre::Real elev;
     Ogre::ColourValue Output;
 
     gSize = this->textureResolution;
     squareTexture = new Ogre::uint8[gSize*gSize*3];
 
-    Ogre::Vector2 upperL, lowerR, edges, sub;
-
-    // Move sample point half a pixel away from edges
-    edges = Ogre::Vector2(0.5f/(gSize-1));
-    // Calculate tile range
-    sub = this->LowerRight - this->UpperLeft;
-    // Scale edges
-    edges = sub*edges;
-    // Add edges to limit the tile by half a pixel
-    upperL = this->UpperLeft + edges;
-    lowerR = this->LowerRight - edges;
-    tGrid = new Grid(gSize, this->getOrientation(), upperL, lowerR);
-
     Ogre::ColourValue water1st, water2nd;
 
     RParam->getWaterFirstColor(red, green, blue);
@@ -301,9 +409,7 @@ void HeightMap::createTexture()
     {
         for(x=0; x < gSize; x++)
         {
-            elev = heightNoise(RParam->getAmplitude(), RParam->getFrequency(),
-                               tGrid->projectToSphere(x,y)+randomTranslate);
-            Output = generatePixel(elev,
+            Output = generatePixel(height[y][x],
                                    seaHeight,
                                    minHeight,
                                    maxHeight,
@@ -319,336 +425,751 @@ void HeightMap::createTexture()
             squareTexture[(y*gSize+x)*3+2] = Output.b;
         }
     }
-
-    delete tGrid;
 }
 
-void HeightMap::load(Ogre::SceneNode *node, Ogre::SceneManager *scene,
-                     const std::string &Name, float scalingFactor)
+void HeightMap::createNormalMap()
 {
-    const std::string meshName = Name + "_mesh";
-    const std::string textureName = Name + "_texture";
-    const std::string matName = Name + "_material";
-    std::string defGrpName = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
+    Ogre::uint32 x, y, xm, xp, ym, yp, gSize = this->textureResolution;
+    std::vector<double> position(gSize*gSize*3);
+    double dX[3], dY[3], normal[3], length, radius, *p;
 
-    /* Do allocation and geometry only when calling load, and remember data is
-     * already there in subsequent loads. */
-    if (this->height == NULL)
+    /* Raster points on the surface. Radius is relative, uniform scaling does
+     * not change normals. */
+    for(y=0; y < gSize; y++)
+    {
+        for(x=0; x < gSize; x++)
+        {
+            p = &position[(y*gSize+x)*3];
+            latticeToSphere(static_cast<double>(x)/rasterStride,
+                            static_cast<double>(y)/rasterStride, p);
+            radius = 1.0 + std::max(height[y][x], seaHeight);
+            for(int i=0; i < 3; i++)
+                p[i] *= radius;
+        }
+    }
+
+    normalMap = new Ogre::uint8[gSize*gSize*3];
+    for(y=0; y < gSize; y++)
     {
-        height = allocate2DArray<float>(this->gridSize, this->gridSize);
-        vertexes = new Ogre::Vector3[gridSize*gridSize];
-        verNorms = new Ogre::Vector3[gridSize*gridSize];
-        txCoords = new Ogre::Vector2[gridSize*gridSize];
-        indexes = new Ogre::uint32[(gridSize-1)*(gridSize-1)*6];
+        // Raster edges have neighbours only on one side
+        ym = y > 0 ? y-1 : y;
+        yp = y < gSize-1 ? y+1 : y;
+        for(x=0; x < gSize; x++)
+        {
+            xm = x > 0 ? x-1 : x;
+            xp = x < gSize-1 ? x+1 : x;
 
-        createGeometry();
-        createTexture();
+            for(int i=0; i < 3; i++)
+            {
+                dX[i] = position[(y*gSize+xp)*3+i] - position[(y*gSize+xm)*3+i];
+                dY[i] = position[(yp*gSize+x)*3+i] - position[(ym*gSize+x)*3+i];
+            }
 
-        generateMeshData(scalingFactor);
+            // Same winding as lattice normals, away from planet centre
+            normal[0] = dX[1]*dY[2] - dX[2]*dY[1];
+            normal[1] = dX[2]*dY[0] - dX[0]*dY[2];
+            normal[2] = dX[0]*dY[1] - dX[1]*dY[0];
+            length = std::sqrt(normal[0]*normal[0] + normal[1]*normal[1]
+                               + normal[2]*normal[2]);
+
+            // Components from -1 - +1 to 0 - 255
+            for(int i=0; i < 3; i++)
+                normalMap[(y*gSize+x)*3+i] = static_cast<Ogre::uint8>((normal[i]/length + 1.0)*127.5 + 0.5);
+        }
+    }
+}
+
+void HeightMap::build(float scalingFactor)
+{
+    height = allocate2DArray<float>(this->textureResolution,
+                                    this->textureResolution);
+    vertexes = new Ogre::Vector3[gridSize*gridSize];
+    verNorms = new Ogre::Vector3[gridSize*gridSize];
+    txCoords = new Ogre::Vector2[gridSize*gridSize];
+
+    /* Bounds have proven ocean to be under water, so sea level is all
+     * there is to know */
+    if (this->ocean)
+    {
+        for(Ogre::uint16 y=0; y < this->textureResolution; y++)
+            std::fill(height[y], height[y] + this->textureResolution, seaHeight);
+    }
+    /* Noise is the expensive part, raster from an earlier session is as
+     * good */
+    else if (this->diskCache == NULL || !this->diskCache->read(this->key, height[0]))
+    {
+        createHeightRaster();
+        if (this->diskCache != NULL)
+            this->diskCache->write(this->key, height[0]);
+    }
+    updateBounds();
+    if (!this->ocean)
+    {
+        createTexture();
+        if (this->normalMapped)
+            createNormalMap();
     }
 
-    bufferMesh(meshName);
-    bufferTexture(textureName);
+    generateMeshData(scalingFactor);
+    measureError(scalingFactor);
+    this->meshBox = meshAABox();
+}
 
-    this->entity = scene->createEntity(Name, meshName);
-    node->attachObject(this->entity);
+void HeightMap::buildInherited(HeightMap *parent, const Ogre::Vector2 &uvOffset,
+                               Ogre::Real uvScale, float scalingFactor)
+{
+    Ogre::uint32 i, x, y, x0, y0, x1, y1, gSize = this->gridSize;
+    Ogre::uint32 pRes = parent->textureResolution;
+    float *rasterX, *rasterY, fx, fy;
+
+    height = allocate2DArray<float>(this->textureResolution,
+                                    this->textureResolution);
+    vertexes = new Ogre::Vector3[gSize*gSize];
+    verNorms = new Ogre::Vector3[gSize*gSize];
+    txCoords = new Ogre::Vector2[gSize*gSize];
+
+    /* Lattice point in parent's raster, from keys rather than float
+     * corners. Child lattice is twice as dense as parent's, and its
+     * lattice point 1 is the corner of its quadrant. */
+    rasterX = new float[gSize];
+    rasterY = new float[gSize];
+    for(i=0; i < gSize; i++)
+    {
+        rasterX[i] = (1.0f + ((this->key.getX() & 1)*(cornerGSize-1) + i - 1.0f)/2.0f)
+                     * parent->rasterStride;
+        rasterY[i] = (1.0f + ((this->key.getY() & 1)*(cornerGSize-1) + i - 1.0f)/2.0f)
+                     * parent->rasterStride;
+    }
 
-    Ogre::MaterialPtr texMap;
+    // Stand-in raster is the lattice, stride is 1
+    for(y=0; y < gSize; y++)
+    {
+        y0 = std::min<Ogre::uint32>(rasterY[y], pRes-1);
+        y1 = std::min<Ogre::uint32>(y0+1, pRes-1);
+        fy = rasterY[y] - y0;
+        for(x=0; x < gSize; x++)
+        {
+            x0 = std::min<Ogre::uint32>(rasterX[x], pRes-1);
+            x1 = std::min<Ogre::uint32>(x0+1, pRes-1);
+            fx = rasterX[x] - x0;
+            height[y][x] = (parent->height[y0][x0]*(1.0f-fx) + parent->height[y0][x1]*fx)*(1.0f-fy)
+                           + (parent->height[y1][x0]*(1.0f-fx) + parent->height[y1][x1]*fx)*fy;
+        }
+    }
 
-    /* FIXME: Should texMap and subMesh have a different (material) name?
-     * Same name works, but different name works as well. */
-    texMap = Ogre::MaterialManager::getSingleton().create(matName ,defGrpName);
+    updateBounds();
+    generateMeshData(scalingFactor);
+    measureError(scalingFactor);
+    this->meshBox = meshAABox();
 
-    texMap->getTechnique(0)->getPass(0)->createTextureUnitState(textureName);
-    texMap->getTechnique(0)->getPass(0)->setSceneBlending(Ogre::SBT_TRANSPARENT_ALPHA);
+    // Centres of parent's texels, like parent's own texture coordinates
+    for(x=0; x < gSize; x++)
+    {
+        for(y=0; y < gSize; y++)
+        {
+            txCoords[x*gSize+y].x = uvOffset.x + uvScale*(rasterX[x] + 0.5f)/static_cast<float>(pRes);
+            txCoords[x*gSize+y].y = uvOffset.y + uvScale*(rasterY[y] + 0.5f)/static_cast<float>(pRes);
+        }
+    }
 
-    this->entity->getMesh()->getSubMesh(0)->setMaterialName(matName);
+    delete[] rasterX;
+    delete[] rasterY;
+}
 
-    // Set texture for the entity
-    this->entity->setMaterial(texMap);
+void HeightMap::completeBuild()
+{
+    this->boundMin = this->rasterMin;
+    this->boundMax = this->rasterMax;
+    this->buildState = BUILD_READY;
 }
 
-void HeightMap::unload(Ogre::SceneNode *node, Ogre::SceneManager *scene)
+HeightMap::BuildState HeightMap::getBuildState()
 {
-    node->detachObject(this->entity->getName());
+    return this->buildState;
+}
 
-    std::string mshName = this->entity->getMesh()->getName();
-    std::string texName = this->entity->getName() + "_texture";
-    std::string matName = this->entity->getName() + "_material";
+void HeightMap::setQueued()
+{
+    this->buildState = BUILD_QUEUED;
+}
 
-    // Unload and remove material, texture and mesh.
-    Ogre::MaterialManager::getSingleton().remove(matName);
-    Ogre::TextureManager::getSingleton().remove(texName);
-    Ogre::MeshManager::getSingleton().remove(mshName);
+void HeightMap::cancel()
+{
+    this->cancelled.store(true);
+}
 
-    scene->destroyEntity(this->entity->getName());
-    this->entity = NULL;
+bool HeightMap::isCancelled()
+{
+    return this->cancelled.load();
 }
 
-Ogre::AxisAlignedBox HeightMap::tileAABox(void)
+void HeightMap::load(Ogre::SceneNode *node, float scalingFactor)
+{
+    upload(scalingFactor);
+    attach(node);
+}
+
+void HeightMap::upload(float scalingFactor)
 {
-    Ogre::Vector3 corner[9], max, min;
-
-    // Upper left with positive height
-    corner[0].x = this->cornerULeft.x;
-    corner[0].y = this->maxHeight+1.0f;
-    corner[0].z = this->cornerULeft.y;
-    //Upper left with minimum height
-    corner[1].x = this->cornerULeft.x;
-    corner[1].y = this->minHeight+1.0f;
-    corner[1].z = this->cornerULeft.y;
-    // Upper right
-    corner[2].x = this->cornerLRight.x;
-    corner[2].y = this->maxHeight+1.0f;
-    corner[2].z = this->cornerULeft.y;
-
-    corner[3].x = this->cornerLRight.x;
-    corner[3].y = this->minHeight+1.0f;
-    corner[3].z = this->cornerULeft.y;
-    // Lower left
-    corner[4].x = this->cornerULeft.x;
-    corner[4].y = this->maxHeight+1.0f;
-    corner[4].z = this->cornerLRight.y;
-
-    corner[5].x = this->cornerULeft.x;
-    corner[5].y = this->minHeight+1.0f;
-    corner[5].z = this->cornerLRight.y;
-    // Lower right
-    corner[6].x = this->cornerLRight.x;
-    corner[6].y = this->maxHeight+1.0f;
-    corner[6].z = this->cornerLRight.y;
-
-    corner[7].x = this->cornerLRight.x;
-    corner[7].y = this->minHeight+1.0f;
-    corner[7].z = this->cornerLRight.y;
-
-    /* Tile center protrudes considerably (especially with full face), so add
-     * it as one of the corners. */
-    corner[8].x = (this->cornerULeft.x + this->cornerLRight.x)/2.0f;
-    corner[8].y = this->maxHeight+1.0f;
-    corner[8].z = (this->cornerULeft.y + this->cornerLRight.y)/2.0f;
-
-    // Rotate and scale
-    for(int i=0; i < 9; i++)
-    {
-        corner[i].normalise();
-        corner[i] = this->orientation*corner[i]*RParam->getRadius();
+    Ogre::TextureUnitState *unit;
+
+    assert(this->buildState != BUILD_QUEUED && this->pool != NULL);
+
+    /* Do allocation and geometry only when calling load, and remember data is
+     * already there in subsequent loads. */
+    if (this->buildState == BUILD_EMPTY)
+    {
+        build(scalingFactor);
+        completeBuild();
     }
 
-    max = corner[0];
-    min = corner[0];
-    for(int i=1; i < 9; i++)
+    // Batcher turns the tile away if a tile of the same key has a slot
+    if (this->batcher != NULL && !this->ocean && this->parentTexture.empty()
+            && this->batcher->insert(this))
     {
-        max.makeCeil(corner[i]);
-        min.makeFloor(corner[i]);
+        this->batched = true;
+        return;
     }
 
-    return Ogre::AxisAlignedBox(min, max);
+    /* Ocean tile and stand-in have no textures of their own. Stand-in
+     * material is pointed to its parent's textures. */
+    if (this->ocean || !this->parentTexture.empty())
+        this->resources = this->pool->acquire(this->cornerGSize, this->compactVertices, 0,
+                                              !this->parentNormals.empty());
+    else
+        this->resources = this->pool->acquire(this->cornerGSize, this->compactVertices,
+                                              this->textureResolution, this->normalMap != NULL);
+
+    bufferMesh();
+
+    if (this->ocean)
+        this->resources->entity->setMaterial(getOceanMaterial());
+    else
+    {
+        if (!this->parentTexture.empty())
+        {
+            unit = this->resources->material->getTechnique(0)->getPass(0)->getTextureUnitState(0);
+            unit->setTextureName(this->parentTexture);
+            if (!this->parentNormals.empty())
+            {
+                unit = this->resources->material->getTechnique(0)->getPass(0)->getTextureUnitState(1);
+                unit->setTextureName(this->parentNormals);
+            }
+        }
+        else
+        {
+            bufferTexture(this->resources->texture, false);
+            if (this->normalMap != NULL)
+                bufferTexture(this->resources->normals, true);
+        }
+        this->resources->entity->setMaterial(this->resources->material);
+    }
 }
 
-void HeightMap::bufferMesh(const std::string &meshName)
+void HeightMap::attach(Ogre::SceneNode *node)
 {
-    Ogre::uint32 i, gSize = this->gridSize;
-    Ogre::MeshPtr mesh;
-    Ogre::SubMesh *subMesh;
-    std::string defGrpName = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
+    if (!isLoaded())
+    {
+        assert(this->standIn != NULL);
+        this->standIn->attach(node);
+        return;
+    }
 
-    // Create mesh and subMesh
-    mesh = Ogre::MeshManager::getSingleton().createManual(meshName, defGrpName);
-    subMesh = mesh->createSubMesh();
+    // Own data replaces the stand-in
+    if (this->standIn != NULL)
+        dropInherited(node->getCreator());
 
-    mesh->sharedVertexData = new Ogre::VertexData;
-    mesh->sharedVertexData->vertexCount = gSize*gSize;
+    if (this->attachedNode != NULL)
+        return;
 
-    // Pointer to declaration of vertexData
-    Ogre::VertexDeclaration* vertexDecl = mesh->sharedVertexData->vertexDeclaration;
+    if (this->batched)
+    {
+        this->batcher->show(this, true);
+        this->attachedNode = node;
+        return;
+    }
 
-    // define elements position, normal and tex coordinate
-    vertexDecl->addElement(0, 0, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
-    vertexDecl->addElement(0, 4*3, Ogre::VET_FLOAT3, Ogre::VES_NORMAL);
-    vertexDecl->addElement(0, 4*6, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES);
+    /* Node transform turns tile relative, and quantised, positions back to
+     * model space */
+    this->tileNode = node->createChildSceneNode(this->tileOrigin);
+    this->tileNode->setScale(this->tileScale, this->tileScale, this->tileScale);
+    this->tileNode->attachObject(this->resources->entity);
 
-    // Vertex buffer
-    Ogre::HardwareVertexBufferSharedPtr vBuf;
+    this->attachedNode = node;
+}
 
-    vBuf = Ogre::HardwareBufferManager::getSingleton()
-           .createVertexBuffer(8*sizeof(float), gSize*gSize,
-                               Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY, false);
+void HeightMap::detach()
+{
+    if (this->standIn != NULL)
+        this->standIn->detach();
 
-    mesh->sharedVertexData->vertexBufferBinding->setBinding(0, vBuf);
+    if (this->attachedNode == NULL)
+        return;
 
-    // Lock the buffer and write vertex data to it
-    float *pVertex;
-    pVertex = static_cast<float *>(vBuf->lock(Ogre::HardwareBuffer::HBL_DISCARD));
-    for(i=0; i < gSize*gSize; i++)
+    if (this->batched)
+        this->batcher->show(this, false);
+    else
     {
-        pVertex[i*8+0] = vertexes[i].x;
-        pVertex[i*8+1] = vertexes[i].y;
-        pVertex[i*8+2] = vertexes[i].z;
-
-        pVertex[i*8+3] = verNorms[i].x;
-        pVertex[i*8+4] = verNorms[i].y;
-        pVertex[i*8+5] = verNorms[i].z;
-
-        pVertex[i*8+6] = txCoords[i].x;
-        pVertex[i*8+7] = txCoords[i].y;
+        this->tileNode->detachObject(this->resources->entity);
+        this->tileNode->getCreator()->destroySceneNode(this->tileNode);
+        this->tileNode = NULL;
     }
-    vBuf->unlock();
 
-    // Index buffer
-    Ogre::HardwareIndexBufferSharedPtr iBuf;
-    Ogre::HardwareIndexBuffer::IndexType itype = Ogre::HardwareIndexBuffer::IT_32BIT;
+    this->attachedNode = NULL;
+}
 
-    iBuf = Ogre::HardwareBufferManager::getSingleton()
-           .createIndexBuffer(itype, (gSize-1)*(gSize-1)*6,
-           Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY, false);
+void HeightMap::unload(Ogre::SceneManager *scene)
+{
+    dropInherited(scene);
 
-    // Lock index buffer
-    unsigned int *pIdx;
-    pIdx = static_cast<unsigned int *>(iBuf->lock(Ogre::HardwareBuffer::HBL_DISCARD));
-    for(i=0; i < (gSize-1)*(gSize-1)*6; i++)
+    if (this->batched)
     {
-        pIdx[i] = indexes[i];
+        detach();
+        this->batcher->remove(this);
+        this->batched = false;
+        return;
     }
-    iBuf->unlock();
 
-    subMesh->useSharedVertices = true;
-    subMesh->indexData->indexBuffer = iBuf;
-    subMesh->indexData->indexCount = (gSize-1)*(gSize-1)*6;
-    subMesh->indexData->indexStart = 0;
+    if (this->resources == NULL)
+        return;
 
-    mesh->_setBounds(tileAABox());
+    detach();
 
-    mesh->load();
+    // Next tile of the same shape overwrites them
+    this->pool->release(this->resources);
+    this->resources = NULL;
 }
 
-void HeightMap::bufferTexture(const std::string &textureName)
+Ogre::uint32 HeightMap::getUploadSize()
 {
-    Ogre::uint32 y, x;
-    Ogre::TexturePtr texture;
-    Ogre::HardwarePixelBufferSharedPtr pixelBuffer;
-    std::string defGrpName = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
-    Ogre::uint16 tRes = this->textureResolution;
+    // Batches have float vertices
+    Ogre::uint32 vertexSize = this->compactVertices && this->batcher == NULL
+                              ? 8*sizeof(Ogre::int16) : 8*sizeof(float);
 
-    texture = Ogre::TextureManager::getSingleton()
-              .createManual(textureName, defGrpName, Ogre::TEX_TYPE_2D,
-                            tRes, tRes, 0, Ogre::PF_R8G8B8, Ogre:: TU_DYNAMIC);
+    if (this->ocean)
+        return this->cornerGSize*this->cornerGSize*vertexSize;
 
-    pixelBuffer = texture->getBuffer();
-    pixelBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
+    // Textures are uploaded with alpha channel
+    return this->cornerGSize*this->cornerGSize*vertexSize
+           + this->textureResolution*this->textureResolution*4*(this->normalMap != NULL ? 2 : 1);
+}
 
-    const Ogre::PixelBox &pixelBox = pixelBuffer->getCurrentLock();
-    Ogre::uint8 *Texture = static_cast<Ogre::uint8*>(pixelBox.data);
+Ogre::uint32 HeightMap::getMemorySize()
+{
+    if (this->height == NULL)
+        return sizeof(HeightMap);
 
-    for(y=0; y < tRes; y++)
+    return sizeof(HeightMap)
+           + this->textureResolution*this->textureResolution*(sizeof(float) + (this->ocean ? 0 : 3)
+                                                              + (this->normalMap != NULL ? 3 : 0))
+           + this->gridSize*this->gridSize*(2*sizeof(Ogre::Vector3) + sizeof(Ogre::Vector2));
+}
+
+void HeightMap::updateBounds()
+{
+    Ogre::uint16 x, y;
+    float low, high;
+
+    low = height[0][0];
+    high = height[0][0];
+    for(y=0; y < textureResolution; y++)
     {
-        for(x=0; x < tRes; x++)
+        for(x=0; x < textureResolution; x++)
         {
-            /* FIXME: Might be unnecessary memory copy, but was convenient. */
-            /* TextureManager did not honor Ogre::PF_R8G8B8, so need to swap
-             * red and blue, plus hardware wants alfa channel values too */
-            Texture[(y*tRes+x)*4]   = squareTexture[(y*tRes+x)*3+2];   // blue
-            Texture[(y*tRes+x)*4+1] = squareTexture[(y*tRes+x)*3+1];   // green
-            Texture[(y*tRes+x)*4+2] = squareTexture[(y*tRes+x)*3];     // red
-            Texture[(y*tRes+x)*4+3] = 255;                             // Alfa
+            low = std::min(low, height[y][x]);
+            high = std::max(high, height[y][x]);
         }
     }
 
-    pixelBuffer->unlock();
+    this->rasterMin = std::max(low, seaHeight);
+    this->rasterMax = std::max(high, seaHeight);
 }
 
-bool HeightMap::createChildren()
+void HeightMap::estimateBounds(Ogre::Vector2 upperLeft, Ogre::Vector2 lowerRight,
+                               float &low, float &high)
 {
-    bool notNull = false;
+    Ogre::Real first, last, spacing, margin, noiseLow, noiseHigh;
+    Ogre::uint16 xStart, xEnd, yStart, yEnd, x, y;
 
-    /* Check all 4 are null pointers */
-    for(int i=0; i < 4; i++)
+    // Ocean raster is sea level, not noise
+    if (this->ocean)
     {
-        if (child[i] != NULL)
-            notNull = true;
+        low = seaHeight;
+        high = seaHeight;
+        return;
     }
 
-    if (notNull)
+    /* Without a raster nothing better than own bounds is known */
+    if (this->buildState != BUILD_READY)
     {
-        std::cerr << "Can't create children heightmaps, at least one non-Null"
-                     "pointer!" << std::endl;
-        return false;
+        low = this->boundMin;
+        high = this->boundMax;
     }
     else
     {
-        Ogre::Vector2 upperL, lowerR;
+        /* Raster samples covering the area. Childs flange is half of this
+         * tile's flange, so it stays inside the raster. */
+        spacing = (this->LowerRight.x - this->UpperLeft.x)/(textureResolution-1);
+        first = (upperLeft.x - this->UpperLeft.x)/spacing;
+        last = (lowerRight.x - this->UpperLeft.x)/spacing;
+        xStart = Ogre::Math::Clamp<Ogre::Real>(Ogre::Math::Floor(std::min(first, last)), 0, textureResolution-1);
+        xEnd = Ogre::Math::Clamp<Ogre::Real>(Ogre::Math::Ceil(std::max(first, last)), 0, textureResolution-1);
+
+        spacing = (this->LowerRight.y - this->UpperLeft.y)/(textureResolution-1);
+        first = (upperLeft.y - this->UpperLeft.y)/spacing;
+        last = (lowerRight.y - this->UpperLeft.y)/spacing;
+        yStart = Ogre::Math::Clamp<Ogre::Real>(Ogre::Math::Floor(std::min(first, last)), 0, textureResolution-1);
+        yEnd = Ogre::Math::Clamp<Ogre::Real>(Ogre::Math::Ceil(std::max(first, last)), 0, textureResolution-1);
+
+        low = height[yStart][xStart];
+        high = height[yStart][xStart];
+        for(y=yStart; y <= yEnd; y++)
+        {
+            for(x=xStart; x <= xEnd; x++)
+            {
+                low = std::min(low, height[y][x]);
+                high = std::max(high, height[y][x]);
+            }
+        }
 
-        upperL = this->cornerULeft;
-        lowerR = upperL + (this->cornerLRight-this->cornerULeft)/2.0f;
-        this->child[0] = new HeightMap(this->cornerGSize, this->orientation, upperL,
-                                       lowerR, this->RParam, this->seaHeight);
+        /* Any point is at most half a cell diagonal from a sample. Distance
+         * on the unit sphere is never longer than on the cube face. */
+        margin = Ogre::Math::Abs(spacing)*Ogre::Math::Sqrt(2.0f)/2.0f
+                 * heightNoiseLipschitz(RParam->getAmplitude(), RParam->getFrequency());
 
-        upperL.x += (this->cornerLRight.x-this->cornerULeft.x)/2.0f;
-        lowerR.x += (this->cornerLRight.x-this->cornerULeft.x)/2.0f;
-        this->child[1] = new HeightMap(this->cornerGSize, this->orientation, upperL,
-                                       lowerR, this->RParam, this->seaHeight);
+        low = std::max(low - margin, minHeight);
+        high = std::min(high + margin, maxHeight);
+    }
 
-        upperL = this->cornerULeft;
-        upperL.y += (this->cornerLRight.y-this->cornerULeft.y)/2.0f;
-        lowerR = upperL + (this->cornerLRight-this->cornerULeft)/2.0f;
-        this->child[2] = new HeightMap(this->cornerGSize, this->orientation, upperL,
-                                       lowerR, this->RParam, this->seaHeight);
+    /* Bounds of the noise itself know nothing of the raster, but octaves
+     * coarser than the area are bound closely */
+    heightNoiseBounds(RParam->getAmplitude(), RParam->getFrequency(), this->randomTranslate,
+                      this->orientation, this->mapping, upperLeft, lowerRight,
+                      noiseLow, noiseHigh);
+    low = std::max<float>(low, noiseLow);
+    high = std::min<float>(high, noiseHigh);
+}
 
-        upperL.x += (this->cornerLRight.x-this->cornerULeft.x)/2.0f;
-        lowerR.x += (this->cornerLRight.x-this->cornerULeft.x)/2.0f;
-        this->child[3] = new HeightMap(this->cornerGSize, this->orientation, upperL,
-                                       lowerR, this->RParam, this->seaHeight);
+Ogre::AxisAlignedBox HeightMap::tileAABox(void)
+{
+    Ogre::Vector3 corner[10], max, min;
+    Ogre::Vector2 center;
+
+    if (this->buildState == BUILD_READY)
+        return this->meshBox;
+
+    /* Corners and center at lowest and highest elevation. Tile center
+     * protrudes considerably (especially with full face), so it is included. */
+    center = (this->cornerULeft + this->cornerLRight)/2.0f;
+    corner[0] = faceToSphere(this->mapping, this->orientation, this->cornerULeft);
+    corner[1] = faceToSphere(this->mapping, this->orientation,
+                             Ogre::Vector2(this->cornerLRight.x, this->cornerULeft.y));
+    corner[2] = faceToSphere(this->mapping, this->orientation,
+                             Ogre::Vector2(this->cornerULeft.x, this->cornerLRight.y));
+    corner[3] = faceToSphere(this->mapping, this->orientation, this->cornerLRight);
+    corner[4] = faceToSphere(this->mapping, this->orientation, center);
+
+    // Scale
+    for(int i=0; i < 5; i++)
+    {
+        corner[i] *= RParam->getRadius();
+        corner[i+5] = corner[i]*(1.0f + this->boundMin);
+        corner[i] *= 1.0f + this->boundMax;
     }
 
-    return true;
+    max = corner[0];
+    min = corner[0];
+    for(int i=1; i < 10; i++)
+    {
+        max.makeCeil(corner[i]);
+        min.makeFloor(corner[i]);
+    }
+
+    return Ogre::AxisAlignedBox(min, max);
 }
 
-bool HeightMap::deleteChildren()
+Ogre::AxisAlignedBox HeightMap::meshAABox(void)
 {
-    bool isNull = false;
+    Ogre::uint32 x, y, gSize = this->gridSize;
+    Ogre::Vector3 max, min;
 
-    /* Check all 4 are non-Null */
-    for(int i=0; i < 4; i++)
+    min = vertexes[gSize+1];
+    max = vertexes[gSize+1];
+    for(x=1; x < gSize-1; x++)
     {
-        if (child[i] == NULL)
-            isNull = true;
+        for(y=1; y < gSize-1; y++)
+        {
+            min.makeFloor(vertexes[x*gSize+y]);
+            max.makeCeil(vertexes[x*gSize+y]);
+        }
     }
+    return Ogre::AxisAlignedBox(min + this->tileOrigin, max + this->tileOrigin);
+}
 
-    if (isNull)
+void HeightMap::measureError(float scalingFactor)
+{
+    Ogre::uint32 x, y, i, j, s = this->rasterStride;
+    float h00, h10, h01, h11, lattice, raster, deviation;
+    Ogre::Real spacing, sag;
+
+    /* Triangles between lattice points are compared to the raster as if
+     * they were bilinear patches. Only cells inside the flange are drawn. */
+    deviation = 0.0f;
+    for(y=1; y < gridSize-2; y++)
     {
-        std::cerr << "Can't delete children, at least one NULL pointer!"
-                  << std::endl;
-        return false;
+        for(x=1; x < gridSize-2; x++)
+        {
+            h00 = std::max(getHeight(x, y), seaHeight);
+            h10 = std::max(getHeight(x+1, y), seaHeight);
+            h01 = std::max(getHeight(x, y+1), seaHeight);
+            h11 = std::max(getHeight(x+1, y+1), seaHeight);
+
+            for(j=0; j <= s; j++)
+            {
+                for(i=0; i <= s; i++)
+                {
+                    lattice = (h00*(s-i) + h10*i)*(s-j) + (h01*(s-i) + h11*i)*j;
+                    lattice /= static_cast<float>(s*s);
+                    raster = std::max(height[y*s+j][x*s+i], seaHeight);
+                    deviation = std::max(deviation, Ogre::Math::Abs(raster - lattice));
+                }
+            }
+        }
+    }
+
+    /* Chord across a cell diagonal. Angle on the sphere is never bigger
+     * than distance on the cube face. */
+    spacing = Ogre::Math::Abs(LowerRight.x - UpperLeft.x)/(gridSize-1);
+    sag = (1.0f + rasterMax)*(1.0f - Ogre::Math::Cos(spacing*Ogre::Math::Sqrt(2.0f)/2.0f));
+
+    this->geometricError = (deviation + sag)*scalingFactor;
+}
+
+void HeightMap::bufferMesh()
+{
+    Ogre::MeshPtr mesh = this->resources->mesh;
+    Ogre::SubMesh *subMesh = mesh->getSubMesh(0);
+
+    /* Only the tile itself is uploaded, flange ring stays in system memory.
+     * Pool made the buffer for the vertex layout used here: short4 position
+     * (w unused), texture coordinate and octahedron-encoded normal as
+     * second texture coordinate set with compact vertices, 16 bytes per
+     * vertex, or float position, normal and texture coordinate. */
+    Ogre::HardwareVertexBufferSharedPtr vBuf
+            = mesh->sharedVertexData->vertexBufferBinding->getBuffer(0);
+
+    if (this->compactVertices)
+    {
+        Ogre::int16 *pVertex;
+        pVertex = static_cast<Ogre::int16 *>(vBuf->lock(Ogre::HardwareBuffer::HBL_DISCARD));
+        fillCompactVertices(pVertex);
+        vBuf->unlock();
     }
     else
     {
-        delete this->child[0];
-        delete this->child[1];
-        delete this->child[2];
-        delete this->child[3];
+        // Lock the buffer and write vertex data to it
+        float *pVertex;
+        pVertex = static_cast<float *>(vBuf->lock(Ogre::HardwareBuffer::HBL_DISCARD));
+        fillVertices(pVertex, Ogre::Vector3::ZERO, Ogre::Vector2::ZERO, 1.0f);
+        vBuf->unlock();
+    }
+
+    // Index buffer is shared between all tiles with same stitched edges
+    subMesh->indexData->indexBuffer = this->patterns->getIndexBuffer(this->stitchMask);
+    subMesh->indexData->indexCount = this->patterns->getIndexCount(this->stitchMask);
+    subMesh->indexData->indexStart = 0;
+
+    // Bounds are in tile space, quantised with compact vertices
+    Ogre::AxisAlignedBox box = tileAABox();
+    mesh->_setBounds(Ogre::AxisAlignedBox((box.getMinimum()-tileOrigin)/tileScale,
+                                          (box.getMaximum()-tileOrigin)/tileScale));
+}
+
+void HeightMap::fillVertices(float *pVertex, const Ogre::Vector3 &offset,
+                             const Ogre::Vector2 &uvOffset, Ogre::Real uvScale)
+{
+    Ogre::uint32 x, y, src, dst, gSize = this->gridSize, tSize = this->cornerGSize;
+
+    for(x=1; x < gSize-1; x++)
+    {
+        for(y=1; y < gSize-1; y++)
+        {
+            src = x*gSize+y;
+            dst = (x-1)*tSize+(y-1);
+
+            pVertex[dst*8+0] = vertexes[src].x + offset.x;
+            pVertex[dst*8+1] = vertexes[src].y + offset.y;
+            pVertex[dst*8+2] = vertexes[src].z + offset.z;
+
+            pVertex[dst*8+3] = verNorms[src].x;
+            pVertex[dst*8+4] = verNorms[src].y;
+            pVertex[dst*8+5] = verNorms[src].z;
 
-        this->child[0] = NULL;
-        this->child[1] = NULL;
-        this->child[2] = NULL;
-        this->child[3] = NULL;
+            pVertex[dst*8+6] = uvOffset.x + uvScale*txCoords[src].x;
+            pVertex[dst*8+7] = uvOffset.y + uvScale*txCoords[src].y;
+        }
     }
+}
 
-    return true;
+void HeightMap::fillCompactVertices(Ogre::int16 *pVertex)
+{
+    Ogre::uint32 x, y, src, dst, gSize = this->gridSize, tSize = this->cornerGSize;
+    Ogre::Vector3 vMin, vMax, quantised;
+    Ogre::Real halfSize;
+
+    /* Uniform scale keeps normals valid in tile space. Vertices are
+     * centred on the tile origin already, up to its rounding. */
+    vMin = vertexes[gSize+1];
+    vMax = vertexes[gSize+1];
+    for(x=1; x < gSize-1; x++)
+    {
+        for(y=1; y < gSize-1; y++)
+        {
+            vMin.makeFloor(vertexes[x*gSize+y]);
+            vMax.makeCeil(vertexes[x*gSize+y]);
+        }
+    }
+    vMax.makeCeil(-vMin);
+    halfSize = std::max(vMax.x, std::max(vMax.y, vMax.z));
+    this->tileScale = halfSize > 0.0f ? halfSize/32767.0f : 1.0f;
+
+    for(x=1; x < gSize-1; x++)
+    {
+        for(y=1; y < gSize-1; y++)
+        {
+            src = x*gSize+y;
+            dst = (x-1)*tSize+(y-1);
+
+            quantised = vertexes[src]/this->tileScale;
+            pVertex[dst*8+0] = static_cast<Ogre::int16>(Ogre::Math::Floor(quantised.x + 0.5f));
+            pVertex[dst*8+1] = static_cast<Ogre::int16>(Ogre::Math::Floor(quantised.y + 0.5f));
+            pVertex[dst*8+2] = static_cast<Ogre::int16>(Ogre::Math::Floor(quantised.z + 0.5f));
+            pVertex[dst*8+3] = 0;
+
+            pVertex[dst*8+4] = static_cast<Ogre::int16>(txCoords[src].x*32767.0f + 0.5f);
+            pVertex[dst*8+5] = static_cast<Ogre::int16>(txCoords[src].y*32767.0f + 0.5f);
+
+            encodeOctahedronNormal(verNorms[src], pVertex[dst*8+6], pVertex[dst*8+7]);
+        }
+    }
+}
+
+void HeightMap::bufferTexture(Ogre::TexturePtr texture, bool normals)
+{
+    Ogre::HardwarePixelBufferSharedPtr pixelBuffer;
+
+    pixelBuffer = texture->getBuffer();
+    pixelBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
+
+    const Ogre::PixelBox &pixelBox = pixelBuffer->getCurrentLock();
+    fillTexture(static_cast<Ogre::uint8*>(pixelBox.data), pixelBox.rowPitch, normals);
+
+    pixelBuffer->unlock();
 }
 
-void HeightMap::getChildren(HeightMap *&upperLeft, HeightMap *&upperRight,
-                            HeightMap *&lowerLeft, HeightMap *&lowerRight)
+void HeightMap::fillTexture(Ogre::uint8 *Texture, Ogre::uint32 rowPitch, bool normals)
 {
-    upperLeft  = this->child[0];
-    upperRight = this->child[1];
-    lowerLeft  = this->child[2];
-    lowerRight = this->child[3];
+    Ogre::uint32 y, x;
+    Ogre::uint16 tRes = this->textureResolution;
+    const Ogre::uint8 *pixels = normals ? this->normalMap : this->squareTexture;
+
+    for(y=0; y < tRes; y++)
+    {
+        for(x=0; x < tRes; x++)
+        {
+            /* FIXME: Might be unnecessary memory copy, but was convenient. */
+            /* TextureManager did not honor Ogre::PF_R8G8B8, so need to swap
+             * red and blue, plus hardware wants alfa channel values too */
+            Texture[(y*rowPitch+x)*4]   = pixels[(y*tRes+x)*3+2];   // blue
+            Texture[(y*rowPitch+x)*4+1] = pixels[(y*tRes+x)*3+1];   // green
+            Texture[(y*rowPitch+x)*4+2] = pixels[(y*tRes+x)*3];     // red
+            Texture[(y*rowPitch+x)*4+3] = 255;                      // Alfa
+        }
+    }
 }
 
-HeightMap *HeightMap::getChild(unsigned char child)
+Ogre::MaterialPtr HeightMap::getOceanMaterial()
 {
+    unsigned char red1st, green1st, blue1st, red2nd, green2nd, blue2nd;
+    unsigned char red, green, blue;
+    char matName[64];
+    Ogre::TexturePtr texture;
+    Ogre::HardwarePixelBufferSharedPtr pixelBuffer;
+    std::string defGrpName = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
+
+    /* Depth is not known without noise, so water is coloured as if it were
+     * half way down, see generatePixel */
+    RParam->getWaterFirstColor(red1st, green1st, blue1st);
+    RParam->getWaterSecondColor(red2nd, green2nd, blue2nd);
+    red = (red1st + red2nd)/2;
+    green = (green1st + green2nd)/2;
+    blue = (blue1st + blue2nd)/2;
+
+    snprintf(matName, sizeof(matName), "PlanetOcean_%02x%02x%02x%s", red, green, blue,
+             this->compactVertices ? "_compact" : "");
+    if (Ogre::MaterialManager::getSingleton().resourceExists(matName))
+        return Ogre::MaterialManager::getSingleton().getByName(matName);
+
+    texture = Ogre::TextureManager::getSingleton()
+              .createManual(std::string(matName) + "_texture", defGrpName, Ogre::TEX_TYPE_2D,
+                            1, 1, 0, Ogre::PF_R8G8B8, Ogre::TU_STATIC_WRITE_ONLY);
+
+    pixelBuffer = texture->getBuffer();
+    pixelBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
+
+    // Same channel order as in bufferTexture
+    Ogre::uint8 *Texture = static_cast<Ogre::uint8*>(pixelBuffer->getCurrentLock().data);
+    Texture[0] = blue;
+    Texture[1] = green;
+    Texture[2] = red;
+    Texture[3] = 255;
+
+    pixelBuffer->unlock();
+
+    return TileResourcePool::createMaterial(matName, std::string(matName) + "_texture", "",
+                                            this->compactVertices);
+}
+
+HeightMap *HeightMap::createChild(Ogre::uint8 child, Ogre::uint16 textureSize)
+{
+    Ogre::Vector2 upperL, half, flange;
+    float low, high;
+    bool ocean;
+    HeightMap *tile;
+
     assert(child < 4);
-    return this->child[child];
+
+    /* Children are upper left, upper right, lower left and lower right */
+    half = (this->cornerLRight-this->cornerULeft)/2.0f;
+    upperL = this->cornerULeft;
+    if (child & 1)
+        upperL.x += half.x;
+    if (child & 2)
+        upperL.y += half.y;
+
+    /* Area of a full child, flange included */
+    flange = half/(this->cornerGSize-1);
+    estimateBounds(upperL - flange, upperL + half + flange, low, high);
+
+    /* Highest possible point of the child is under water. Ocean stays
+     * ocean all the way down. */
+    ocean = this->oceanPatterns != NULL && (this->ocean || high <= this->seaHeight);
+    if (ocean)
+        tile = new HeightMap(this->oceanPatterns->getSize(), 2, this->orientation, upperL,
+                             upperL + half, this->RParam, this->seaHeight,
+                             this->oceanPatterns, this->oceanPatterns, this->compactVertices);
+    else
+        tile = new HeightMap(this->cornerGSize, textureSize, this->orientation, upperL,
+                             upperL + half, this->RParam, this->seaHeight,
+                             this->patterns, this->oceanPatterns, this->compactVertices);
+    tile->ocean = ocean;
+    tile->pool = this->pool;
+    tile->mapping = this->mapping;
+    tile->key = this->key.getChild(child);
+    tile->boundMin = std::max(low, this->seaHeight);
+    tile->boundMax = std::max(high, this->seaHeight);
+
+    return tile;
 }
 
 Ogre::Vector3 HeightMap::getCenterPosition()
@@ -657,40 +1178,194 @@ Ogre::Vector3 HeightMap::getCenterPosition()
     Ogre::Vector3 pos;
 
     tileCenter = (this->cornerULeft + this->cornerLRight)/2.0f;
-    pos = Ogre::Vector3(tileCenter.x, 1.0f, tileCenter.y).normalisedCopy();
+    pos = faceToSphere(this->mapping, this->orientation, tileCenter);
+
+    return pos*RParam->getRadius();
+}
 
-    return this->orientation*pos*RParam->getRadius();
+bool HeightMap::isOcean()
+{
+    return this->ocean;
 }
 
 bool HeightMap::isLoaded()
 {
-    if (this->entity != NULL)
+    if (this->resources != NULL || this->batched)
         return true;
     else
         return false;
 }
 
+bool HeightMap::isAttached()
+{
+    if (this->standIn != NULL && this->standIn->isAttached())
+        return true;
+    return this->attachedNode != NULL;
+}
+
+void HeightMap::inherit(HeightMap *parent, float scalingFactor)
+{
+    Ogre::Vector2 uvOffset = Ogre::Vector2::ZERO;
+    Ogre::Real uvScale = 1.0f;
+
+    assert(!isLoaded() && this->standIn == NULL);
+    assert(parent->isLoaded() && parent->height != NULL && !parent->ocean);
+
+    this->standIn = new HeightMap(this->cornerGSize, 2, this->orientation,
+                                  this->cornerULeft, this->cornerLRight, this->RParam,
+                                  this->seaHeight, this->patterns, NULL,
+                                  this->compactVertices);
+    this->standIn->key = this->key;
+    this->standIn->stitchMask = this->stitchMask;
+    this->standIn->pool = this->pool;
+    this->standIn->mapping = this->mapping;
+    if (parent->batched)
+        parent->batcher->getTextures(parent, this->standIn->parentTexture,
+                                     this->standIn->parentNormals, uvOffset, uvScale);
+    else
+    {
+        this->standIn->parentTexture = parent->resources->texture->getName();
+        if (parent->normalMap != NULL)
+            this->standIn->parentNormals = parent->resources->normals->getName();
+    }
+
+    this->standIn->buildInherited(parent, uvOffset, uvScale, scalingFactor);
+    this->standIn->completeBuild();
+    this->standIn->upload(scalingFactor);
+}
+
+bool HeightMap::isInheriting()
+{
+    return this->standIn != NULL;
+}
+
+void HeightMap::dropInherited(Ogre::SceneManager *scene)
+{
+    if (this->standIn == NULL)
+        return;
+
+    this->standIn->unload(scene);
+    delete this->standIn;
+    this->standIn = NULL;
+}
+
 void HeightMap::getCornerPosition(Ogre::Vector3 &upperLeft, Ogre::Vector3 &upperRight,
                                   Ogre::Vector3 &lowerLeft, Ogre::Vector3 &lowerRight)
 {
-    upperLeft = Ogre::Vector3(this->cornerULeft.x, 1.0f, this->cornerULeft.y);
-    upperLeft.normalise();
-    upperLeft = this->orientation*upperLeft*RParam->getRadius();
+    upperLeft = faceToSphere(this->mapping, this->orientation, this->cornerULeft);
+    upperLeft *= RParam->getRadius();
 
-    upperRight = Ogre::Vector3(this->cornerLRight.x, 1.0f, this->cornerULeft.y);
-    upperRight.normalise();
-    upperRight = this->orientation*upperRight*RParam->getRadius();
+    upperRight = faceToSphere(this->mapping, this->orientation,
+                              Ogre::Vector2(this->cornerLRight.x, this->cornerULeft.y));
+    upperRight *= RParam->getRadius();
 
-    lowerLeft = Ogre::Vector3(this->cornerULeft.x, 1.0f, this->cornerLRight.y);
-    lowerLeft.normalise();
-    lowerLeft = this->orientation*lowerLeft*RParam->getRadius();
+    lowerLeft = faceToSphere(this->mapping, this->orientation,
+                             Ogre::Vector2(this->cornerULeft.x, this->cornerLRight.y));
+    lowerLeft *= RParam->getRadius();
 
-    lowerRight = Ogre::Vector3(this->cornerLRight.x, 1.0f, this->cornerLRight.y);
-    lowerRight.normalise();
-    lowerRight = this->orientation*lowerRight*RParam->getRadius();
+    lowerRight = faceToSphere(this->mapping, this->orientation, this->cornerLRight);
+    lowerRight *= RParam->getRadius();
 }
 
 Ogre::Real HeightMap::getAmplitude()
 {
     return this->maxHeight*RParam->getRadius();
 }
+
+void HeightMap::getBounds(float &minElevation, float &maxElevation)
+{
+    minElevation = this->boundMin;
+    maxElevation = this->boundMax;
+}
+
+Ogre::AxisAlignedBox HeightMap::getBoundingBox()
+{
+    return tileAABox();
+}
+
+Ogre::Real HeightMap::getGeometricError()
+{
+    return this->geometricError;
+}
+
+void HeightMap::getTileRange(Ogre::Vector2 &upperLeft, Ogre::Vector2 &lowerRight)
+{
+    upperLeft = this->cornerULeft;
+    lowerRight = this->cornerLRight;
+}
+
+Ogre::uint8 HeightMap::getLevel()
+{
+    return this->key.getLevel();
+}
+
+void HeightMap::setDiskCache(TileDiskCache *diskCache)
+{
+    this->diskCache = diskCache;
+}
+
+void HeightMap::setNormalMap(bool enable)
+{
+    this->normalMapped = enable;
+}
+
+void HeightMap::setResourcePool(TileResourcePool *pool)
+{
+    this->pool = pool;
+}
+
+void HeightMap::setBatcher(TileBatcher *batcher)
+{
+    this->batcher = batcher;
+}
+
+Ogre::uint16 HeightMap::getTextureResolution()
+{
+    return this->textureResolution;
+}
+
+bool HeightMap::hasNormalMap()
+{
+    return this->normalMap != NULL;
+}
+
+Ogre::Vector3 HeightMap::getTileOrigin()
+{
+    return this->tileOrigin;
+}
+
+void HeightMap::setKey(const TileKey &key)
+{
+    this->key = key;
+}
+
+TileKey HeightMap::getKey()
+{
+    return this->key;
+}
+
+void HeightMap::setStitchMask(Ogre::uint8 mask)
+{
+    if (this->standIn != NULL)
+        this->standIn->setStitchMask(mask);
+
+    if (mask == this->stitchMask)
+        return;
+
+    this->stitchMask = mask;
+
+    if (this->batched)
+        this->batcher->setStitchMask(this, mask);
+    else if (this->resources != NULL)
+    {
+        Ogre::SubMesh *subMesh = this->resources->mesh->getSubMesh(0);
+        subMesh->indexData->indexBuffer = this->patterns->getIndexBuffer(mask);
+        subMesh->indexData->indexCount = this->patterns->getIndexCount(mask);
+    }
+}
+
+Ogre::uint8 HeightMap::getStitchMask()
+{
+    return this->stitchMask;
+}
+
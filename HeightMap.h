@@ -23,48 +23,113 @@
 #ifndef HEIGHTMAP_H
 #define HEIGHTMAP_H
 
+#include <atomic>
 #include <OgreVector2.h>
 #include <OgreVector3.h>
 #include <OgreMatrix3.h>
+#include <OgreMaterial.h>
 #include "Grid.h"
 #include "ResourceParameter.h"
+#include "TileIndexPatterns.h"
+#include "TileKey.h"
+#include "TileDiskCache.h"
+#include "TileResourcePool.h"
+
+class TileBatcher;
 
 class HeightMap: public Grid
 {
 public:
+    /* Tile data lifecycle as seen by the render thread */
+    enum BuildState {BUILD_EMPTY, BUILD_QUEUED, BUILD_READY};
+
+    /* Tile of size*size vertices with a height raster and texture of about
+     * textureSize*textureSize texels, see rasterResolution. Children that
+     * are under sea level are made as ocean tiles with oceanPatterns, NULL
+     * makes every child a full tile. */
     HeightMap(unsigned int size,
+              Ogre::uint16 textureSize,
               const Ogre::Matrix3 face,
               Ogre::Vector2 UpperLeft,
               Ogre::Vector2 LowerRight,
               ResourceParameter *param,
-              Ogre::Real Height_sea);
+              Ogre::Real Height_sea,
+              TileIndexPatterns *patterns,
+              TileIndexPatterns *oceanPatterns,
+              bool compactVertices = false);
 	~HeightMap();
-	void setHeight(unsigned int x, unsigned int y, float elevation);
+
+    /* Side of the height raster of a tile with size*size vertices, a whole
+     * number of lattice intervals and at most textureSize, unless that is
+     * less than one texel per interval */
+    static Ogre::uint16 rasterResolution(Ogre::uint32 size, Ogre::uint16 textureSize);
+
+    /* Height of a geometry lattice point, sampled from the height raster */
+    float getHeight(unsigned int x, unsigned int y);
     Ogre::Vector3 projectToSphere(unsigned int x, unsigned int y, float elevation);
 
-    /* Fills hardware-buffers with vertice- and texture-data. Creates entity
-     * called Name, mesh called Name+"_mesh", material called Name+"_material",
-     * textureUnitState called Name+"_texture".
-     * Attachs entity to a given node. */
-    void load(Ogre::SceneNode *node, Ogre::SceneManager *scene,
-              const std::string &Name, float scalingFactor);
+    /* Generates height raster, texture and vertex data. Touches nothing
+     * shared, so it can be run in a worker thread. */
+    void build(float scalingFactor);
+
+    /* Marks built data ready for loading. Render thread only, after build
+     * has finished. */
+    void completeBuild();
+
+    BuildState getBuildState();
+
+    /* Tile was handed to a worker */
+    void setQueued();
+
+    /* Tile is no longer needed. Worker skips building it, and whoever
+     * receives it back deletes it. */
+    void cancel();
+    bool isCancelled();
+
+    /* Uploads and attaches tile, see upload and attach. */
+    void load(Ogre::SceneNode *node, float scalingFactor);
+
+    /* Fills hardware-buffers with vertice- and texture-data. Entity, mesh,
+     * textures and material are borrowed from the resource pool and
+     * overwritten. Ocean tile uses the shared ocean material instead. With
+     * a batcher the tile goes to its batch and borrows nothing. Builds tile
+     * data first, if that is not done already. */
+    void upload(float scalingFactor);
+
+    /* Attachs entity to a child node of a given node, which carries tile
+     * origin and, with compact vertices, scale. Batched tile is shown in
+     * its batch instead. Before the tile is loaded its stand-in is attached
+     * instead, and dropped once it is. */
+    void attach(Ogre::SceneNode *node);
 
-    /* Detach and destroy entity */
-    void unload(Ogre::SceneNode *node, Ogre::SceneManager *scene);
+    void detach();
 
-    /* Creates 4 children, unless at least one child pointer is already
-     * non-null, which results in not creating any children. */
-    bool createChildren();
+    /* Detach entity and return it to the pool, and drop the stand-in */
+    void unload(Ogre::SceneManager *scene);
 
-    /* Deletes 4 children, unless at least one child pointer is already null,
-     * which results in no children to be deleted. */
-    bool deleteChildren();
+    /* Uploads a stand-in to be drawn until this tile is loaded: the
+     * lattice sampled from the parent's height raster, textured with the
+     * matching quarter of the parent's textures. Parent has to stay loaded
+     * as long as this is inheriting. Render thread only, but the tile may
+     * be building meanwhile: nothing a worker writes is read. */
+    void inherit(HeightMap *parent, float scalingFactor);
 
-    /* Returns pointers to children */
-    void getChildren(HeightMap *&upperLeft, HeightMap *&upperRight,
-                     HeightMap *&lowerLeft, HeightMap *&lowerRight);
+    /* Tile has a stand-in using its parent's textures */
+    bool isInheriting();
 
-    HeightMap *getChild(unsigned char child);
+    /* Unload and delete the stand-in */
+    void dropInherited(Ogre::SceneManager *scene);
+
+    /* Bytes written to hardware buffers by upload */
+    Ogre::uint32 getUploadSize();
+
+    /* Bytes of tile data held in main memory */
+    Ogre::uint32 getMemorySize();
+
+    /* New tile for one quadrant of this one, children are upper left,
+     * upper right, lower left and lower right. Key, cube mapping and bounds
+     * estimate come from this tile, caller owns the child. */
+    HeightMap *createChild(Ogre::uint8 child, Ogre::uint16 textureSize);
 
     Ogre::Vector3 getCenterPosition();
 
@@ -73,53 +138,224 @@ public:
 
     Ogre::Real getAmplitude();
 
+    /* Elevation range of tile geometry, relative to unit radius like
+     * heights. Exact once the tile is built, before that a conservative
+     * estimate from the parent's height raster, or the global range. */
+    void getBounds(float &minElevation, float &maxElevation);
+
+    /* Box around tile geometry in the planet's frame. Exact once the tile
+     * is built, before that made from bounds. */
+    Ogre::AxisAlignedBox getBoundingBox();
+
+    /* Largest distance between tile geometry and the surface it stands
+     * for, in the same units as vertices. Only valid once built. */
+    Ogre::Real getGeometricError();
+
+    /* Tile is entirely under sea level, which was known before it was
+     * built. Ocean tile is flat at sea level, drawn with a coarse lattice
+     * inside full edges, and has no noise and a material shared with other
+     * ocean tiles. */
+    bool isOcean();
+
+    /* Tile has hardware buffers and an entity, or a slot in a batch */
     bool isLoaded();
+
+    /* Tile is attached to the scene and drawn */
+    bool isAttached();
+
+    /* Tile area in cube face coordinates, without flange */
+    void getTileRange(Ogre::Vector2 &upperLeft, Ogre::Vector2 &lowerRight);
+
+    /* Depth in the quadtree, root is 0 */
+    Ogre::uint8 getLevel();
+
+    /* Height raster is read from diskCache when stored there, and written
+     * to it after generating. Set before the tile is built. */
+    void setDiskCache(TileDiskCache *diskCache);
+
+    /* Bakes a normal map of the height raster along with the texture, and
+     * uses a normal mapped material. Set before the tile is built. Ocean
+     * tiles are flat and ignore this. */
+    void setNormalMap(bool enable);
+
+    /* Hardware resources are borrowed from pool when loading. Children and
+     * stand-ins get the pool of their parent, root's is set by its owner
+     * before it is loaded. */
+    void setResourcePool(TileResourcePool *pool);
+
+    /* Tile is loaded into a batch of batcher instead of an entity of its
+     * own, NULL loads it alone. Set before the tile is loaded. Ocean tiles
+     * and stand-ins are never batched. */
+    void setBatcher(TileBatcher *batcher);
+
+    /* Writes the uploaded vertices as floats like bufferMesh, positions
+     * moved by offset and texture coordinates scaled and moved into an
+     * atlas. Only valid once built. */
+    void fillVertices(float *pVertex, const Ogre::Vector3 &offset,
+                      const Ogre::Vector2 &uvOffset, Ogre::Real uvScale);
+
+    /* Writes texture, or normal map, as BGRA rows rowPitch pixels apart.
+     * Only valid once built. */
+    void fillTexture(Ogre::uint8 *pixels, Ogre::uint32 rowPitch, bool normals);
+
+    Ogre::uint16 getTextureResolution();
+    bool hasNormalMap();
+
+    /* Centre of tile geometry in the planet's frame, vertices are relative
+     * to it. Only valid once built. */
+    Ogre::Vector3 getTileOrigin();
+
+    /* Children get keys from their parent, root key is set by its owner */
+    void setKey(const TileKey &key);
+    TileKey getKey();
+
+    /* Edges that are stitched to a coarser neighbour, bits as in
+     * TileIndexPatterns. Swaps index buffer of a loaded tile. */
+    void setStitchMask(Ogre::uint8 mask);
+    Ogre::uint8 getStitchMask();
 private:
+    /* Height raster at texture resolution, covering the same area as the
+     * geometry lattice. Lattice point (x, y) is raster point
+     * (x*rasterStride, y*rasterStride). */
     float           **height;
     float           minHeight;
     float           maxHeight;
     float           seaHeight;
+    float           boundMin;
+    float           boundMax;
+    // Raster range written by build, copied to bounds in completeBuild
+    float           rasterMin;
+    float           rasterMax;
+    // Written by build like raster range, read once ready
+    Ogre::Real      geometricError;
+    Ogre::AxisAlignedBox meshBox;
     Ogre::uint16    textureResolution;
+    Ogre::uint16    rasterStride;
+    // NULL for ocean tiles
     Ogre::uint8     *squareTexture;
+    /* Normals of the raster in the planet's frame, mapped to 0 - 255. NULL
+     * when not normal mapped. */
+    Ogre::uint8     *normalMap;
+    bool            normalMapped;
     Ogre::Vector3   randomTranslate;
 
-    HeightMap       *child[4];
+    TileKey         key;
+    BuildState      buildState;
+    std::atomic<bool> cancelled;
 
-    /* Tile dimensions without flange/skirt */
+    /* Tile dimensions without flange. Flange vertices are only used for
+     * normals and are not uploaded. */
     Ogre::Vector2   cornerULeft;
     Ogre::Vector2   cornerLRight;
     Ogre::uint32    cornerGSize;
 
+    /* Relative to tileOrigin, so that vertices keep their precision on big
+     * planets and deep levels */
 	Ogre::Vector3	*vertexes;
 	Ogre::Vector3	*verNorms;
 	Ogre::Vector2	*txCoords;
-	Ogre::uint32	*indexes;
 
-    Ogre::Entity    *entity;
+    /* Shared index buffers, one for every combination of stitched edges */
+    TileIndexPatterns *patterns;
+    TileIndexPatterns *oceanPatterns;
+    Ogre::uint8     stitchMask;
+    bool            ocean;
+    TileDiskCache   *diskCache;
+
+    // Borrowed while loaded on its own, NULL otherwise
+    TileResourcePool::Resources *resources;
+    TileResourcePool *pool;
     ResourceParameter *RParam;
 
+    /* 16 bytes per vertex instead of 32: tile-relative 16-bit positions,
+     * octahedron-encoded normals and 16-bit texture coordinates. Requires
+     * shader based material PlanetTile/Compact. */
+    bool            compactVertices;
+    Ogre::SceneNode *tileNode;
+    Ogre::SceneNode *attachedNode;
+    // Loaded into a slot of batcher, without an entity
+    TileBatcher     *batcher;
+    bool            batched;
+    // Centre of tile geometry in the planet's frame
+    Ogre::Vector3   tileOrigin;
+    Ogre::Real      tileScale;
+
+    // Drawn until this tile is loaded, see inherit
+    HeightMap       *standIn;
+    // Textures of the parent, which a stand-in uses instead of its own
+    std::string     parentTexture;
+    std::string     parentNormals;
+
+    /* Vertex normals from central differences of lattice neighbours, one
+     * sided on the flange. Rows are processed four vertices at a time when
+     * SSE is available. */
 	void calculateNormals();
 
-    /* Fold tile flanges into skirts */
-    void foldSkirts(float scaling);
+    /* Normal of one vertex. Positions are given as separate x, y and z
+     * lattices. */
+    Ogre::Vector3 latticeNormal(const float *posX, const float *posY, const float *posZ,
+                                Ogre::uint32 x, Ogre::uint32 y);
 
-    /* Creates vertex-data and indexes */
+    /* Creates vertex-data. Positions are calculated in double precision
+     * from the tile key and stored relative to the tile origin. */
     void generateMeshData(float scalingFactor);
 
-    /* Creates geometry for heightmap */
-    void createGeometry();
+    /* Unit sphere point of a lattice point, in double precision. Fractions
+     * are points between lattice points, like raster points. */
+    void latticeToSphere(double x, double y, double position[3]);
+
+    /* Samples noise into the height raster */
+    void createHeightRaster();
 
-    /* Creates square bitmap to be used as a texture */
+    /* Creates square bitmap to be used as a texture by mapping the height
+     * raster through the colour palette */
     void createTexture();
 
+    /* Creates normal map from central differences of the height raster on
+     * the sphere. Positions are in double precision, raster spacing is
+     * below float precision on deep levels. */
+    void createNormalMap();
+
+    /* Finds raster range, lattice is clamped to sea level */
+    void updateBounds();
+
+    /* Estimates elevation range of an area from the part of this tile's
+     * raster it covers, widened by how much noise can change between raster
+     * samples, and narrowed by heightNoiseBounds. Not clamped to sea level. */
+    void estimateBounds(Ogre::Vector2 upperLeft, Ogre::Vector2 lowerRight,
+                        float &low, float &high);
+
+    /* Builds a stand-in: raster is just the lattice, bilinearly sampled
+     * from parent's raster, and texture coordinates point to the parent's
+     * textures, scaled and moved to where they are in an atlas. */
+    void buildInherited(HeightMap *parent, const Ogre::Vector2 &uvOffset,
+                        Ogre::Real uvScale, float scalingFactor);
+
+    /* Deviation of the lattice from the height raster between lattice
+     * points, plus how far flat triangles sag below the sphere. */
+    void measureError(float scalingFactor);
+
     /* Calculate AABox for HeightMap mesh */
     Ogre::AxisAlignedBox tileAABox(void);
 
-    /* Creates and fills hardware-buffer with vertex-data */
-    void bufferMesh(const std::string &meshName);
+    /* Box of inner vertices. Triangles lie inside the convex hull of their
+     * vertices, so this is exact. */
+    Ogre::AxisAlignedBox meshAABox(void);
+
+    /* Fills borrowed vertex-buffer with vertex-data, and sets index buffer
+     * and bounds */
+    void bufferMesh();
+
+    /* Fills vertex-buffer with 16-bit positions relative to tile origin and
+     * scaled, octahedron-encoded normals and 16-bit texture coordinates */
+    void fillCompactVertices(Ogre::int16 *pVertex);
+
+    /* Fills borrowed texture of raster size with texture, or normal map */
+    void bufferTexture(Ogre::TexturePtr texture, bool normals);
 
-    /* Creates and fills hardware-buffer with texture-data */
-    void bufferTexture(const std::string &textureName);
+    /* Material of all ocean tiles with the same water colours. Created on
+     * first use with a one texel texture, and kept after tiles unload. */
+    Ogre::MaterialPtr getOceanMaterial();
 };
 
 #endif // HEIGHTMAP_H
@@ -0,0 +1,118 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include <iostream>
+#include <algorithm>
+#include "LodConfig.h"
+
+/* Tile keys hold 28 bits of x and y, but tile corners, probes and bounds
+ * use float face coordinates. Their 24 bits keep deeper corners apart,
+ * not the points inside the tiles. */
+#define DEPTH_LIMIT 18
+#define VERTICES_LIMIT 257
+#define TEXTURE_LIMIT 4096
+
+LodConfig::LodConfig()
+{
+    this->maxDepth = 6;
+    this->cubeMapping = Grid::MAPPING_GNOMONIC;
+    this->tileVertices = 33;
+    this->oceanVertices = 9;
+    this->textureSizes.push_back(128);
+    this->normalMaps = false;
+    this->batchTiles = false;
+    this->cacheBudget = 32*1024*1024;
+    this->uploadBudget = 512*1024;
+}
+
+bool LodConfig::validate()
+{
+    bool valid = true;
+
+    if (this->maxDepth > DEPTH_LIMIT)
+    {
+        std::cerr << "LOD depth " << (int)this->maxDepth << " is too deep, using "
+                  << DEPTH_LIMIT << std::endl;
+        this->maxDepth = DEPTH_LIMIT;
+        valid = false;
+    }
+
+    if (this->tileVertices < 3 || this->tileVertices > VERTICES_LIMIT)
+    {
+        std::cerr << "Tile needs 3 to " << VERTICES_LIMIT << " vertices per edge, got "
+                  << this->tileVertices << std::endl;
+        this->tileVertices = std::max<Ogre::uint16>(3, std::min<Ogre::uint16>(this->tileVertices, VERTICES_LIMIT));
+        valid = false;
+    }
+
+    /* Tile edges are stitched to coarser neighbours by skipping every other
+     * edge vertex, so tiles need an even number of intervals. */
+    if (this->tileVertices % 2 == 0)
+    {
+        std::cerr << "Tile vertices per edge must be odd, using "
+                  << this->tileVertices + 1 << std::endl;
+        this->tileVertices++;
+        valid = false;
+    }
+
+    /* Ocean lattice uses every n'th vertex of a full tile inside its edges,
+     * so its intervals have to divide those of a full tile. Three vertices
+     * always do. */
+    if (this->oceanVertices < 3 || this->oceanVertices > this->tileVertices
+            || (this->tileVertices-1) % (this->oceanVertices-1) != 0)
+    {
+        std::cerr << "Ocean tile needs 3 to " << this->tileVertices << " vertices per edge, "
+                  << "with intervals dividing " << this->tileVertices-1 << ", got "
+                  << this->oceanVertices << std::endl;
+        this->oceanVertices = std::max<Ogre::uint16>(3, std::min(this->oceanVertices, this->tileVertices));
+        while ((this->tileVertices-1) % (this->oceanVertices-1) != 0)
+            this->oceanVertices--;
+        valid = false;
+    }
+
+    if (this->textureSizes.empty())
+    {
+        std::cerr << "No tile texture size given, using 128" << std::endl;
+        this->textureSizes.push_back(128);
+        valid = false;
+    }
+
+    for(unsigned int i=0; i < this->textureSizes.size(); i++)
+    {
+        if (this->textureSizes[i] < 2 || this->textureSizes[i] > TEXTURE_LIMIT)
+        {
+            std::cerr << "Tile texture size must be 2 to " << TEXTURE_LIMIT
+                      << ", got " << this->textureSizes[i] << " for level " << i << std::endl;
+            this->textureSizes[i] = std::max<Ogre::uint16>(2, std::min<Ogre::uint16>(this->textureSizes[i], TEXTURE_LIMIT));
+            valid = false;
+        }
+    }
+
+    return valid;
+}
+
+Ogre::uint16 LodConfig::getTextureSize(Ogre::uint8 level) const
+{
+    if (level >= this->textureSizes.size())
+        return this->textureSizes.back();
+    return this->textureSizes[level];
+}
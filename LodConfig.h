@@ -0,0 +1,86 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef LODCONFIG_H
+#define LODCONFIG_H
+
+#include <vector>
+#include <OgrePrerequisites.h>
+#include "Grid.h"
+
+/* Level of detail settings of a planet, given to PSphere when it is
+ * created. Defaults are what planets had before these could be set. */
+struct LodConfig
+{
+    LodConfig();
+
+    /* Clamps settings to usable values. Every change is reported to
+     * std::cerr. Returns false if something had to be changed. */
+    bool validate();
+
+    /* Texels along a tile edge at given level */
+    Ogre::uint16 getTextureSize(Ogre::uint8 level) const;
+
+    // Deepest quadtree level, root is level 0, validate keeps it at most 18
+    Ogre::uint8                 maxDepth;
+
+    /* Cube face to sphere mapping of tiles, rasters and the grids of
+     * PSphere. Tangent mapping samples the sphere more evenly, so
+     * tileVertices or maxDepth can be lower for the same detail. */
+    Grid::CubeMapping           cubeMapping;
+
+    // Vertices along a tile edge. Odd, so that edges can be stitched.
+    Ogre::uint16                tileVertices;
+
+    /* Vertices along an ocean tile, which is flat at sea level and not
+     * refined for detail. Its edges keep all tileVertices vertices so they
+     * stitch to full tiles, inside them every (tileVertices-1)/
+     * (oceanVertices-1)'th vertex is drawn. Intervals have to divide those
+     * of tileVertices. */
+    Ogre::uint16                oceanVertices;
+
+    /* Height raster and texture texels along a tile edge, from level 0 on.
+     * Deeper levels than listed use the last one. Rounded down to whole
+     * lattice intervals by HeightMap, but never below one texel per
+     * interval. */
+    std::vector<Ogre::uint16>   textureSizes;
+
+    /* Tiles carry a normal map baked from the height raster, and are drawn
+     * with shader based materials. Relief then reads correctly from coarser
+     * tiles, so maxDepth can usually be a level or two lower. */
+    bool                        normalMaps;
+
+    /* Loaded tiles of a face are drawn in batches of up to 16 nearby tiles
+     * of one level, sharing vertex buffer, texture atlas and material,
+     * instead of one entity each. Usually a level of a face takes one or
+     * two batches. Batched tiles have float vertices even with compact
+     * vertices. Ocean tiles are not batched. */
+    bool                        batchTiles;
+
+    // Bytes of built tiles kept in the tile cache
+    Ogre::uint32                cacheBudget;
+
+    // Bytes of tile data uploaded to the GPU per frame
+    Ogre::uint32                uploadBudget;
+};
+
+#endif // LODCONFIG_H
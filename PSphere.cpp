@@ -26,6 +26,10 @@
 #include <stdlib.h>
 #include "ObjectInfo.h"
 #include <vector>
+#include <algorithm>
+#include <sstream>
+#include <map>
+#include <random>
 #include "OGRE/Ogre.h"
 #include "PSphere.h"
 #include <OgreMeshSerializer.h>
@@ -47,24 +51,52 @@ using namespace std;
 
 #define TESTVECS 40000  // Number of vectors to get height statistics
 #define BRACKETS 100    // Number of histogram-slots between min and max height
+#define PREFETCH_STEPS 2 // Points on predicted observer path
 
-PSphere::PSphere(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParameter resourceParameter){
+PSphere::PSphere(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParameter resourceParameter,
+                 bool compactVertices){
 
-	observer =	Ogre::Vector3(0.0f, 0.0f, 0.0f);
-    this->scene =   NULL;
-    this->node =    NULL;
+    /* Odd count was always made of an even one without complaint */
+    if (iters % 2 == 0)
+        iters++;
+    this->lodConfig.tileVertices = std::min<Ogre::uint32>(iters, 0xffff);
 
-	create(iters, gridSize, resourceParameter);
+	create(gridSize, resourceParameter, compactVertices);
+}
+
+PSphere::PSphere(const LodConfig &lod, Ogre::uint32 gridSize, ResourceParameter resourceParameter,
+                 bool compactVertices){
+
+    this->lodConfig = lod;
+
+	create(gridSize, resourceParameter, compactVertices);
 }
 
 PSphere::~PSphere()
 {
+    delete faceUpdater;
     delete faceXM;
     delete faceXP;
     delete faceYM;
     delete faceYP;
     delete faceZM;
     delete faceZP;
+    // Nothing left to invalidate when the last tiles are collected
+    faces.clear();
+
+    /* Faces cancelled tiles that workers still had, delete them once
+     * they are handed back. */
+    tileWorkers->stop();
+    collectTiles();
+    delete tileWorkers;
+    delete tileCache;
+    // Cache unloaded the last batched tiles
+    delete tileBatcher;
+    delete tilePool;
+    for(unsigned int i=0; i < tileDiskCaches.size(); i++)
+        delete tileDiskCaches[i];
+    delete tilePatterns;
+    delete oceanPatterns;
 
     delete gridXM;
     delete gridXP;
@@ -74,18 +106,25 @@ PSphere::~PSphere()
     delete gridZP;
 }
 
-void PSphere::create(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParameter resourceParameter)
+void PSphere::create(Ogre::uint32 gridSize, ResourceParameter resourceParameter, bool compactVertices)
 {
+    this->lodConfig.validate();
+
+	observer =	Ogre::Vector3(0.0f, 0.0f, 0.0f);
+    this->scene =   NULL;
+    this->node =    NULL;
+    this->compactVertices = compactVertices;
+    this->uploadBudget = this->lodConfig.uploadBudget;
+    this->viewportHeight = 600.0f;
+    this->fieldOfView = Ogre::Degree(45.0f);
+    this->pixelTolerance = 4.0f;
+    this->observerVelocity = Ogre::Vector3::ZERO;
+    this->prefetchTime = 1.0f;
+    this->parallelUpdate = true;
+
     RParameter = resourceParameter;
     float waterFraction = resourceParameter.getWaterFraction();
 
-    // Iters less than 3 are pointless
-    if(iters < 3)
-    {
-        iters = 3;
-        std::cout << "Sphere needs atleast 3 iters" << std::endl;
-    }
-
     /* Make grid big enough, so that so that grid-depending code doesn't make
      * anything nasty. Probably need to be tested. */
     if (gridSize < 2)
@@ -109,25 +148,62 @@ void PSphere::create(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParamete
 
     calculateSeaLevel(minimumHeight, maximumHeight, waterFraction);
 
+    tilePatterns = new TileIndexPatterns(lodConfig.tileVertices);
+    oceanPatterns = new TileIndexPatterns(lodConfig.tileVertices,
+                                          (lodConfig.tileVertices-1)/(lodConfig.oceanVertices-1));
+    tileWorkers = new TileWorkerPool();
+    tileCache = new TileCache(lodConfig.cacheBudget);
+    tilePool = new TileResourcePool();
+
     // No rotation
-    faceYP = new PquadTree("YP", iters, noRot, seaHeight, &RParameter);
+    faceYP = new PquadTree("YP", 0, lodConfig, noRot, seaHeight, &RParameter,
+                           tilePatterns, oceanPatterns, tileWorkers, tileCache,
+                           tilePool, compactVertices);
     gridYP = new Grid(gridSize, noRot, upperL_g, lowerR_g);
     // 90 degrees through z-axis
-    faceXM = new PquadTree("XM", iters, rotZ_90, seaHeight, &RParameter);
+    faceXM = new PquadTree("XM", 1, lodConfig, rotZ_90, seaHeight, &RParameter,
+                           tilePatterns, oceanPatterns, tileWorkers, tileCache,
+                           tilePool, compactVertices);
     gridXM = new Grid(gridSize, rotZ_90, upperL_g, lowerR_g);
     // 180 degrees through z-axis
-    faceYM = new PquadTree("YM", iters, rotZ_180, seaHeight, &RParameter);
+    faceYM = new PquadTree("YM", 2, lodConfig, rotZ_180, seaHeight, &RParameter,
+                           tilePatterns, oceanPatterns, tileWorkers, tileCache,
+                           tilePool, compactVertices);
     gridYM = new Grid(gridSize, rotZ_180, upperL_g, lowerR_g);
     // 270 degrees through z-axis
-    faceXP = new PquadTree("XP", iters, rotZ_270, seaHeight, &RParameter);
+    faceXP = new PquadTree("XP", 3, lodConfig, rotZ_270, seaHeight, &RParameter,
+                           tilePatterns, oceanPatterns, tileWorkers, tileCache,
+                           tilePool, compactVertices);
     gridXP = new Grid(gridSize, rotZ_270, upperL_g, lowerR_g);
     // 90 degrees through x-axis
-    faceZP = new PquadTree("ZP", iters, rotX_90, seaHeight, &RParameter);
+    faceZP = new PquadTree("ZP", 4, lodConfig, rotX_90, seaHeight, &RParameter,
+                           tilePatterns, oceanPatterns, tileWorkers, tileCache,
+                           tilePool, compactVertices);
     gridZP = new Grid(gridSize, rotX_90, upperL_g, lowerR_g);
     // 270 degrees through x-axis
-    faceZM = new PquadTree("ZM", iters, rotX_270, seaHeight, &RParameter);
+    faceZM = new PquadTree("ZM", 5, lodConfig, rotX_270, seaHeight, &RParameter,
+                           tilePatterns, oceanPatterns, tileWorkers, tileCache,
+                           tilePool, compactVertices);
     gridZM = new Grid(gridSize, rotX_270, upperL_g, lowerR_g);
 
+    faces.push_back(faceYP);
+    faces.push_back(faceXM);
+    faces.push_back(faceYM);
+    faces.push_back(faceXP);
+    faces.push_back(faceZP);
+    faces.push_back(faceZM);
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->setNeighbours(faces);
+    faceUpdater = new FaceUpdatePool(faces);
+
+    tileBatcher = NULL;
+    if (lodConfig.batchTiles)
+    {
+        tileBatcher = new TileBatcher(tilePatterns);
+        for(unsigned int i=0; i < faces.size(); i++)
+            faces[i]->setBatcher(tileBatcher);
+    }
+
     gridYP->setNeighbours(gridXM, gridXP, gridZP, gridZM);
     gridXM->setNeighbours(gridYM, gridYP, gridZP, gridZM);
     gridYM->setNeighbours(gridXP, gridXM, gridZP, gridZM);
@@ -135,6 +211,13 @@ void PSphere::create(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParamete
     gridZP->setNeighbours(gridXM, gridXP, gridYM, gridYP);
     gridZM->setNeighbours(gridXM, gridXP, gridYP, gridYM);
 
+    gridYP->setMapping(lodConfig.cubeMapping);
+    gridXM->setMapping(lodConfig.cubeMapping);
+    gridYM->setMapping(lodConfig.cubeMapping);
+    gridXP->setMapping(lodConfig.cubeMapping);
+    gridZP->setMapping(lodConfig.cubeMapping);
+    gridZM->setMapping(lodConfig.cubeMapping);
+
     // Requires variable seaHeight that is set by calculateSeaLevel
     setGridLandInfo(gridYP);
     setGridLandInfo(gridXM);
@@ -151,6 +234,8 @@ void PSphere::calculateSeaLevel(float &minElev, float &maxElev, float seaFractio
     unsigned int histogram[BRACKETS]={0};
     Ogre::Real testHeight[TESTVECS];
     Ogre::Vector3 testVec;
+    // Own generator, global rand state depends on what ran before
+    std::minstd_rand generator(RParameter.getSeed());
 
     vector <float> frequency = RParameter.getFrequency();
     vector <float> amplitude = RParameter.getAmplitude();
@@ -162,9 +247,9 @@ void PSphere::calculateSeaLevel(float &minElev, float &maxElev, float seaFractio
      * statistics for height-histogram */
     for(i=0; i < TESTVECS; i++)
     {
-        testVec = Ogre::Vector3(static_cast<float>((rand() % 65536)-32768),
-                                static_cast<float>((rand() % 65536)-32768),
-                                static_cast<float>((rand() % 65536)-32768));
+        testVec = Ogre::Vector3(static_cast<float>(static_cast<int>(generator() % 65536)-32768),
+                                static_cast<float>(static_cast<int>(generator() % 65536)-32768),
+                                static_cast<float>(static_cast<int>(generator() % 65536)-32768));
         testVec.normalise();
         testHeight[i] = heightNoise(amplitude, frequency, testVec + randomTranslate);
         if (minElev > testHeight[i])
@@ -296,23 +381,296 @@ void PSphere::setGridLandInfo(Grid *grid)
 
 void PSphere::setObserverPosition(Ogre::Vector3 position)
 {
+    setObserverPosition(position, NULL);
+}
+
+void PSphere::setObserverPosition(Ogre::Vector3 position, const Ogre::Frustum *frustum)
+{
+    std::vector<Ogre::Plane> planes;
+    std::vector<Ogre::Vector3> path;
+    Ogre::Vector3 normal, point;
+    Ogre::Quaternion toLocal;
+    bool changed;
+
     /* Avoid updating before scene is set */
     if ( (this->scene != NULL) && (this->node != NULL) )
     {
         /* Convert to model coordinates */
         this->observer = this->node->convertWorldToLocalPosition(position);
 
-        faceYP->update(this->observer);
-        faceXM->update(this->observer);
-        faceYM->update(this->observer);
-        faceXP->update(this->observer);
-        faceZP->update(this->observer);
-        faceZM->update(this->observer);
+        /* Far plane is left out, it may be at infinity. Planes are moved
+         * with a point on them and their normal. */
+        if (frustum != NULL)
+        {
+            toLocal = this->node->_getDerivedOrientation().Inverse();
+            for(int i=Ogre::FRUSTUM_PLANE_NEAR; i <= Ogre::FRUSTUM_PLANE_BOTTOM; i++)
+            {
+                if (i == Ogre::FRUSTUM_PLANE_FAR)
+                    continue;
+
+                const Ogre::Plane &plane = frustum->getFrustumPlane(i);
+                point = this->node->convertWorldToLocalPosition(plane.normal*(-plane.d));
+                normal = toLocal*plane.normal;
+                planes.push_back(Ogre::Plane(normal, point));
+            }
+        }
+
+        collectTiles();
+
+        /* Faces decide their trees independently. Scene and caches are
+         * changed only in commit, on this thread. */
+        changed = false;
+        if (this->parallelUpdate)
+            changed = faceUpdater->update(this->observer, planes);
+        else
+        {
+            for(unsigned int i=0; i < faces.size(); i++)
+            {
+                if (faces[i]->update(this->observer, planes))
+                    changed = true;
+            }
+        }
+
+        // Nothing moved and no tile arrived, tree is as it was
+        if (!changed)
+            return;
+
+        /* Neighbouring tiles may differ only by one level, so that edges can
+         * be stitched without cracks. Restricting is done over all faces
+         * before loading anything. */
+        PquadTree::restrictNeighbours(faces);
+
+        std::vector<PquadTree::UploadRequest> uploads;
+        for(unsigned int i=0; i < faces.size(); i++)
+            faces[i]->commit(uploads);
+
+        uploadTiles(uploads);
+
+        for(unsigned int i=0; i < faces.size(); i++)
+            faces[i]->updateStitching();
+
+        // Batches draw what was attached and stitched above
+        if (tileBatcher != NULL)
+            tileBatcher->update();
+
+        /* Prefetching is done last so that it uses worker time left over
+         * from tiles needed now */
+        if (this->observerVelocity != Ogre::Vector3::ZERO)
+        {
+            for(int i=1; i <= PREFETCH_STEPS; i++)
+                path.push_back(this->node->convertWorldToLocalPosition(position
+                        + this->observerVelocity*this->prefetchTime*i/PREFETCH_STEPS));
+        }
+        for(unsigned int i=0; i < faces.size(); i++)
+            faces[i]->prefetch(path);
     }
     else
         this->observer = position;
 }
 
+void PSphere::collectTiles()
+{
+    std::vector<HeightMap*> tiles;
+
+    tileWorkers->collectCompleted(tiles);
+    for(unsigned int i=0; i < tiles.size(); i++)
+    {
+        if (tiles[i]->isCancelled())
+            delete tiles[i];
+        else
+            tiles[i]->completeBuild();
+    }
+
+    // New tiles can be refined or uploaded
+    if (!tiles.empty())
+    {
+        for(unsigned int i=0; i < faces.size(); i++)
+            faces[i]->invalidate();
+    }
+}
+
+static bool moreUrgent(const PquadTree::UploadRequest &a,
+                       const PquadTree::UploadRequest &b)
+{
+    return a.priority > b.priority;
+}
+
+void PSphere::uploadTiles(std::vector<PquadTree::UploadRequest> &uploads)
+{
+    Ogre::uint32 bytes = 0, size;
+
+    std::sort(uploads.begin(), uploads.end(), moreUrgent);
+
+    /* At least one tile per frame, so big tiles can't stall loading */
+    for(unsigned int i=0; i < uploads.size(); i++)
+    {
+        size = uploads[i].tile->getUploadSize();
+        if (i > 0 && bytes + size > this->uploadBudget)
+            break;
+
+        uploads[i].face->uploadTile(uploads[i].tile);
+        bytes += size;
+    }
+
+    /* Uploaded tiles are attached and the rest requested again on the next
+     * commit, which has to run even if the view stays put */
+    if (!uploads.empty())
+    {
+        for(unsigned int i=0; i < faces.size(); i++)
+            faces[i]->invalidate();
+    }
+}
+
+bool PSphere::setTileDiskCache(const std::string &directory)
+{
+    std::map<Ogre::uint16, TileDiskCache*> bySize;
+    std::vector<TileDiskCache*> perLevel;
+    Ogre::uint16 rasterSize;
+
+    // Workers may still read the old ones
+    if (!tileDiskCaches.empty())
+    {
+        std::cerr << "Tile disk cache can be set only once" << std::endl;
+        return false;
+    }
+
+    /* Pack records are of one raster size, levels with different texture
+     * sizes go to packs of their own */
+    for(unsigned int level=0; level <= lodConfig.maxDepth; level++)
+    {
+        rasterSize = HeightMap::rasterResolution(lodConfig.tileVertices,
+                                                 lodConfig.getTextureSize(level));
+        if (bySize.count(rasterSize) == 0)
+        {
+            std::stringstream fileName;
+
+            /* Rasters of another cube mapping or tile lattice sample other
+             * points */
+            fileName << directory << "/planet_" << std::hex << RParameter.getTerrainHash()
+                     << std::dec << "_" << rasterSize << "_v" << lodConfig.tileVertices
+                     << (lodConfig.cubeMapping == Grid::MAPPING_TANGENT ? "_tan" : "") << ".pack";
+            bySize[rasterSize] = new TileDiskCache(fileName.str(), RParameter.getTerrainHash(),
+                                                   rasterSize, lodConfig.tileVertices);
+            tileDiskCaches.push_back(bySize[rasterSize]);
+        }
+        perLevel.push_back(bySize[rasterSize]);
+    }
+
+    for(unsigned int i=0; i < tileDiskCaches.size(); i++)
+    {
+        if (!tileDiskCaches[i]->isOpen())
+        {
+            for(unsigned int j=0; j < tileDiskCaches.size(); j++)
+                delete tileDiskCaches[j];
+            tileDiskCaches.clear();
+            return false;
+        }
+    }
+
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->setDiskCaches(perLevel);
+
+    return true;
+}
+
+const LodConfig &PSphere::getLodConfig()
+{
+    return this->lodConfig;
+}
+
+TileCache *PSphere::getTileCache()
+{
+    return this->tileCache;
+}
+
+void PSphere::setUploadBudget(Ogre::uint32 bytesPerFrame)
+{
+    this->uploadBudget = bytesPerFrame;
+}
+
+void PSphere::setProjection(Ogre::Real viewportHeight, Ogre::Radian fovY)
+{
+    this->viewportHeight = viewportHeight;
+    this->fieldOfView = fovY;
+
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->setErrorMetric(viewportHeight, fovY, this->pixelTolerance);
+}
+
+void PSphere::setPixelTolerance(Ogre::Real pixels)
+{
+    if (pixels <= 0.0f)
+    {
+        std::cerr << "Pixel tolerance must be positive, got " << pixels << std::endl;
+        pixels = 1.0f;
+    }
+    this->pixelTolerance = pixels;
+
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->setErrorMetric(this->viewportHeight, this->fieldOfView, pixels);
+}
+
+void PSphere::setObserverVelocity(Ogre::Vector3 velocity)
+{
+    this->observerVelocity = velocity;
+}
+
+void PSphere::setPrefetch(Ogre::Real lookahead, Ogre::uint8 depth, Ogre::uint32 maxTiles)
+{
+    if (lookahead < 0.0f)
+    {
+        std::cerr << "Prefetch lookahead can't be negative, got " << lookahead << std::endl;
+        lookahead = 0.0f;
+    }
+    this->prefetchTime = lookahead;
+
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->setPrefetch(depth, maxTiles);
+}
+
+void PSphere::setParallelUpdate(bool parallel)
+{
+    this->parallelUpdate = parallel;
+}
+
+void PSphere::setLodHysteresis(Ogre::Real ratio)
+{
+    if (ratio <= 0.0f || ratio > 1.0f)
+    {
+        std::cerr << "LOD hysteresis must be in (0, 1], got " << ratio << std::endl;
+        ratio = Ogre::Math::Clamp(ratio, 0.1f, 1.0f);
+    }
+
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->setHysteresis(ratio);
+}
+
+void PSphere::setUpdateTolerance(Ogre::Real distance)
+{
+    if (distance < 0.0f)
+    {
+        std::cerr << "Update tolerance can't be negative, got " << distance << std::endl;
+        distance = 0.0f;
+    }
+
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->setUpdateTolerance(distance);
+}
+
+void PSphere::getLodEvents(Ogre::uint32 &splits, Ogre::uint32 &merges)
+{
+    Ogre::uint32 faceSplits, faceMerges;
+
+    splits = 0;
+    merges = 0;
+    for(unsigned int i=0; i < faces.size(); i++)
+    {
+        faces[i]->getLodEvents(faceSplits, faceMerges);
+        splits += faceSplits;
+        merges += faceMerges;
+    }
+}
+
 Ogre::Real PSphere::getObserverDistanceToSurface()
 {
     return observer.length() - getSurfaceHeight(this->observer);
@@ -365,6 +723,10 @@ void PSphere::load(Ogre::SceneNode *parent, Ogre::SceneManager *scene, const std
     faceXP->setScene(scene, node);
     faceZP->setScene(scene, node);
     faceZM->setScene(scene, node);
+    tileCache->setScene(scene);
+    tilePool->setScene(scene);
+    if (tileBatcher != NULL)
+        tileBatcher->setScene(scene, node);
 }
 
 void PSphere::unload(Ogre::SceneManager *scene)
@@ -639,6 +1001,10 @@ bool PSphere::getGridLocation(Ogre::Vector3 location, Grid **face,
 		return false;
 	}
 
+	// Face plane to face coordinates, which grid cells are uniform in
+	x_f = Grid::unwarp(grid->getMapping(), x_f);
+	y_f = Grid::unwarp(grid->getMapping(), y_f);
+
 	iy = (unsigned short)((1.0f+y_f)/2.0f*grid->getSize());
 	ix = (unsigned short)((1.0f+x_f)/2.0f*grid->getSize());
 
@@ -822,6 +1188,9 @@ unsigned char *PSphere::exportMap(unsigned short width, unsigned short height, M
         temp[0] = new Grid(gSize, gridXP->getOrientation(), upperL, lowerR);
         temp[5] = new Grid(gSize, gridZP->getOrientation(), upperL, lowerR);
         temp[4] = new Grid(gSize, gridZM->getOrientation(), upperL, lowerR);
+        // Faces are sampled like tiles, so exported cube matches the planet
+        for(i=0; i < 6; i++)
+            temp[i]->setMapping(lodConfig.cubeMapping);
 
 		// 4 equatorial tiles
 		for(i=0; i < 4; i++)
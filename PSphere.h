@@ -26,9 +26,16 @@
 #include "ObjectInfo.h"
 #include "Grid.h"
 #include "HeightMap.h"
+#include "LodConfig.h"
 #include "ResourceParameter.h"
 #include "CollisionManager.h"
+#include "FaceUpdatePool.h"
 #include "PquadTree.h"
+#include "TileBatcher.h"
+#include "TileCache.h"
+#include "TileResourcePool.h"
+#include "TileIndexPatterns.h"
+#include "TileWorkerPool.h"
 
 using namespace std;
 
@@ -79,6 +86,55 @@ public:
      * not in worldspace. In other words, one must undo rotations. */
 	void setObserverPosition(Ogre::Vector3 position);
 
+    /* As above, and tiles outside frustum are not refined. Frustum is in
+     * worldspace, like cameras are. */
+    void setObserverPosition(Ogre::Vector3 position, const Ogre::Frustum *frustum);
+
+    /* Observer velocity in worldspace units per second. Tiles the observer
+     * would need along its path are built in the background. */
+    void setObserverVelocity(Ogre::Vector3 velocity);
+
+    /* Path predicted lookahead seconds ahead is prefetched, down to depth
+     * levels below current tiles, with at most maxTiles tiles per cube face
+     * waiting for workers. Zero depth turns prefetching off. */
+    void setPrefetch(Ogre::Real lookahead, Ogre::uint8 depth, Ogre::uint32 maxTiles);
+
+    /* Stores tile height rasters in pack files in directory and reads
+     * them back in later sessions, one pack for each raster size in use.
+     * File names come from terrain parameters, so planets can share a
+     * directory. Returns false if a pack can't be opened. Use before the first observer update. */
+    bool setTileDiskCache(const std::string &directory);
+
+    /* Tiles recently dropped from the quadtree. Budget and hit counts can
+     * be read and changed through it. */
+    TileCache *getTileCache();
+
+    /* Limits bytes of tile data uploaded to the GPU per frame. Most urgent
+     * tiles go first, the rest wait for following frames. */
+    void setUploadBudget(Ogre::uint32 bytesPerFrame);
+
+    /* Viewport height in pixels and vertical field of view of the camera
+     * the planet is seen through. Tile detail follows these. */
+    void setProjection(Ogre::Real viewportHeight, Ogre::Radian fovY);
+
+    /* How many pixels tile geometry may be off on screen before a finer
+     * tile is used. Smaller is more detailed. */
+    void setPixelTolerance(Ogre::Real pixels);
+
+    /* Cube faces decide their tiles in parallel threads, on by default */
+    void setParallelUpdate(bool parallel);
+
+    /* Split tiles are merged back only when their error is below ratio
+     * times pixel tolerance. Ratio is in (0, 1], 1 means no hysteresis. */
+    void setLodHysteresis(Ogre::Real ratio);
+
+    /* Tile selection is skipped while the observer moves less than distance
+     * between frames and the view does not turn */
+    void setUpdateTolerance(Ogre::Real distance);
+
+    /* Tiles split and merged during the last frame, over all faces */
+    void getLodEvents(Ogre::uint32 &splits, Ogre::uint32 &merges);
+
     /* Gives observer distance to the point on surface that is directly between
      * observer and planet origo.
      * Negative values mean that the observer is inside the planet */
@@ -118,11 +174,24 @@ public:
 	bool exportMap(unsigned short width, unsigned short height, string fileName, MapType type);
 
     /* Generates a map and gives pointer to array that has rgb-image
-     * information. Then MapType is MAP_CUBE, ignores height variable.
+     * information. Then MapType is MAP_CUBE, ignores height variable, and
+     * faces are sampled with the cube mapping of the planet.
      * With wrong type, returns NULL-pointer. */
 	unsigned char *exportMap(unsigned short width, unsigned short height, MapType type);
 
-    PSphere(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParameter resourceParameter);
+    /* With compactVertices planet tiles use quantised 16 bytes per vertex
+     * format, which needs shader support. Tiles have iters vertices per
+     * edge, other level of detail settings are defaults. */
+    PSphere(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParameter resourceParameter,
+            bool compactVertices = false);
+
+    /* As above, with level of detail settings from lod. Invalid settings
+     * are reported and clamped. */
+    PSphere(const LodConfig &lod, Ogre::uint32 gridSize, ResourceParameter resourceParameter,
+            bool compactVertices = false);
+
+    /* Settings in use, after validation */
+    const LodConfig &getLodConfig();
 
 	ResourceParameter *getParameters();
 
@@ -139,6 +208,20 @@ private:
     PquadTree           *faceXP;
     PquadTree           *faceZP;
     PquadTree           *faceZM;
+    vector<PquadTree*>  faces;
+    // Threads updating faces when parallelUpdate is set
+    FaceUpdatePool      *faceUpdater;
+    TileIndexPatterns   *tilePatterns;
+    // Coarser lattice of tiles that are all under sea level
+    TileIndexPatterns   *oceanPatterns;
+    TileWorkerPool      *tileWorkers;
+    TileCache           *tileCache;
+    // Hardware resources of loaded tiles, reused as tiles come and go
+    TileResourcePool    *tilePool;
+    // NULL unless lodConfig.batchTiles is set
+    TileBatcher         *tileBatcher;
+    // One for every raster size in use
+    vector<TileDiskCache*> tileDiskCaches;
 	Grid			*gridYP;
 	Grid			*gridXM;
 	Grid			*gridYM;
@@ -153,12 +236,27 @@ private:
 	CollisionManager	*CollisionDetectionManager;
 	Ogre::Real			maximumHeight;
 	Ogre::Real			minimumHeight;
+    bool                compactVertices;
+    Ogre::uint32        uploadBudget;
+    LodConfig           lodConfig;
+    Ogre::Real          viewportHeight;
+    Ogre::Radian        fieldOfView;
+    Ogre::Real          pixelTolerance;
+    Ogre::Vector3       observerVelocity;
+    Ogre::Real          prefetchTime;
+    bool                parallelUpdate;
 
     // Makes a sphere out of a cube that is made of 6 squares
-	void create(Ogre::uint32 iters, Ogre::uint32 gridSize, ResourceParameter resourceParameter);
+	void create(Ogre::uint32 gridSize, ResourceParameter resourceParameter, bool compactVertices);
 
     void calculateSeaLevel(float &minElev, float &maxElev, float seaFraction);
 
+    /* Takes tiles finished by workers into use, and deletes cancelled ones */
+    void collectTiles();
+
+    /* Uploads requested tiles in priority order within upload budget */
+    void uploadTiles(std::vector<PquadTree::UploadRequest> &uploads);
+
     /* Generates surface-texturemap using noise-generated height differences.
      * Expects pointer to be already correctly allocated. */
     void generateImage(unsigned short width, unsigned short height, unsigned char *image);
@@ -20,157 +20,1055 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE. */
 
-#include <sstream>
+#include <cassert>
+#include <algorithm>
+#include <functional>
 #include "PquadTree.h"
 
-#define MAX_LEVEL 6
+// Updates a subtree outside the frustum is kept before it is merged
+#define CULL_GRACE_FRAMES 120
 
-PquadTree::PquadTree(const std::string name, Ogre::uint16 levelSize,
-                     Ogre::Matrix3 orientation, Ogre::Real seaHeight,
-                     ResourceParameter *parameters)
+// Prefetches are queued below this, tiles needed now stay at -1 or above
+#define PREFETCH_PRIORITY -2.0f
+
+/* Cosine of the angle between direction from point to viewer and point
+ * itself. Double precision, both are far from the planet centre. */
+static double tiltTowards(const Ogre::Vector3 &viewer, const Ogre::Vector3 &point)
+{
+    double toViewer[3], dot = 0.0, viewerLength = 0.0, pointLength = 0.0;
+
+    for(int i=0; i < 3; i++)
+    {
+        toViewer[i] = static_cast<double>(viewer[i]) - point[i];
+        dot += toViewer[i]*point[i];
+        viewerLength += toViewer[i]*toViewer[i];
+        pointLength += static_cast<double>(point[i])*point[i];
+    }
+    if (viewerLength <= 0.0 || pointLength <= 0.0)
+        return 1.0;
+
+    return dot/std::sqrt(viewerLength*pointLength);
+}
+
+PquadTree::PquadTree(const std::string name, Ogre::uint8 faceIndex,
+                     const LodConfig &lod, Ogre::Matrix3 orientation,
+                     Ogre::Real seaHeight,
+                     ResourceParameter *parameters, TileIndexPatterns *patterns,
+                     TileIndexPatterns *oceanPatterns,
+                     TileWorkerPool *workers, TileCache *cache,
+                     TileResourcePool *pool, bool compactVertices)
 {
     Ogre::Vector2 upperLeft, lowerRight;
-    Ogre::Real angle, diff;
+    HeightMap *root;
+    TileNode node;
+    float maxHeight;
     
     this->name = name;
+    this->orientation = orientation;
     this->params = parameters;
-    this->runningNumber = 0;
+    this->workers = workers;
+    this->cache = cache;
+    this->batcher = NULL;
+    this->lod = lod;
+    this->viewer = Ogre::Vector3::ZERO;
+    this->pixelTolerance = 4.0f;
+    this->mergeRatio = 0.7f;
+    this->updateTolerance = parameters->getRadius()*1e-4f;
+    this->dirty = true;
+    this->splitCount = 0;
+    this->mergeCount = 0;
+    this->prefetchDepth = 1;
+    this->prefetchBudget = 8;
+    // 600 pixels high viewport with 45 degree field of view
+    this->errorScale = 600.0f/(2.0f*Ogre::Math::Tan(Ogre::Math::PI/8.0f));
 
     upperLeft = Ogre::Vector2(-1.0f, 1.0f);
     lowerRight = Ogre::Vector2(1.0f, -1.0f);
 
-    this->root = new HeightMap(levelSize, orientation, upperLeft, lowerRight,
-                               parameters, seaHeight);
+    root = new HeightMap(lod.tileVertices, lod.getTextureSize(0), orientation,
+                         upperLeft, lowerRight,
+                         parameters, seaHeight, patterns, oceanPatterns, compactVertices);
+    this->rootKey = TileKey(faceIndex, 0, 0, 0);
+    root->setKey(this->rootKey);
+    root->setNormalMap(lod.normalMaps);
+    root->setMapping(lod.cubeMapping);
+    root->setResourcePool(pool);
+
+    node.tile = root;
+    node.split = false;
+    node.visibleLeaf = false;
+    node.culledFrames = 0;
+    this->nodes[this->rootKey.getPacked()] = node;
+
+    /* Lowest possible terrain anywhere on the planet works as an occluding
+     * sphere. Corners are scaled down to it. */
+    root->getBounds(this->occluderHeight, maxHeight);
+    this->cornerScaling = 1.0f + this->occluderHeight;
+}
+
+PquadTree::~PquadTree()
+{
+    for(PrefetchTable::iterator it = this->prefetching.begin();
+            it != this->prefetching.end(); ++it)
+        releaseTile(it->second.tile);
+    this->prefetching.clear();
+
+    merge(this->rootKey);
+    retire(getNode(this->rootKey).tile);
+    this->nodes.clear();
+    applyCommands();
+}
+
+PquadTree::TileNode &PquadTree::getNode(const TileKey &key)
+{
+    NodeTable::iterator it = this->nodes.find(key.getPacked());
+
+    assert(it != this->nodes.end());
+    return it->second;
+}
+
+void PquadTree::merge(const TileKey &key)
+{
+    std::vector<TileKey> stack, subtree;
+    NodeTable::iterator it;
+    TileNode &node = getNode(key);
+    TileKey current;
+
+    if (node.split == false)
+        return;
+
+    for(int i=0; i < 4; i++)
+        stack.push_back(key.getChild(i));
+    node.split = false;
+    this->mergeCount++;
+
+    while (!stack.empty())
+    {
+        current = stack.back();
+        stack.pop_back();
+        subtree.push_back(current);
+
+        if (getNode(current).split)
+        {
+            for(int i=0; i < 4; i++)
+                stack.push_back(current.getChild(i));
+        }
+    }
 
-    // Scaling factor for corners
-    this->cornerScaling = (this->params->getRadius() - this->root->getAmplitude())
-                          / this->params->getRadius();
+    /* Children go before parents, their stand-ins may use textures of the
+     * parent */
+    for(int i=subtree.size()-1; i >= 0; i--)
+    {
+        it = this->nodes.find(subtree[i].getPacked());
+        retire(it->second.tile);
+        this->nodes.erase(it);
+    }
+}
+
+void PquadTree::retire(HeightMap *tile)
+{
+    TreeCommand command;
+
+    command.type = TreeCommand::RELEASE;
+    command.tile = tile;
+    this->commands.push_back(command);
+}
+
+void PquadTree::releaseTile(HeightMap *tile)
+{
+    // Parent's textures may be gone by the time tile is used again
+    tile->dropInherited(this->scene);
+
+    /* Worker still holds the tile, it is deleted when handed back */
+    if (tile->getBuildState() == HeightMap::BUILD_QUEUED)
+        tile->cancel();
+    // Cache unloads it if it keeps no hardware buffers
+    else if (tile->getBuildState() == HeightMap::BUILD_READY)
+        this->cache->insert(tile);
+    else
+    {
+        if (tile->isLoaded())
+            tile->unload(this->scene);
+        delete tile;
+    }
+}
+
+void PquadTree::makeLeaf(const TileKey &key)
+{
+    TileNode &node = getNode(key);
+
+    node.visibleLeaf = true;
+
+    /* Children stay drawn until this tile is uploaded to replace them */
+    if (node.tile->isLoaded())
+        merge(key);
+    else if (node.split)
+    {
+        for(int i=0; i < 4; i++)
+            clearVisibleLeaves(key.getChild(i));
+    }
+}
+
+HeightMap *PquadTree::createChild(HeightMap *parent, Ogre::uint8 child)
+{
+    Ogre::uint8 level = parent->getKey().getLevel() + 1;
+    HeightMap *tile;
+
+    tile = parent->createChild(child, this->lod.getTextureSize(level));
+    tile->setNormalMap(this->lod.normalMaps);
+    tile->setBatcher(this->batcher);
+    if (level < this->diskCaches.size() && !tile->isOcean())
+        tile->setDiskCache(this->diskCaches[level]);
+
+    return tile;
+}
+
+void PquadTree::split(const TileKey &key)
+{
+    TileNode &node = getNode(key);
+    TreeCommand command;
+    TileNode child;
+
+    node.visibleLeaf = false;
+
+    /* Create children if not done in previous frame. Built ones are looked
+     * up when the command is applied. */
+    if (node.split == false)
+    {
+        child.split = false;
+        child.visibleLeaf = false;
+        child.culledFrames = 0;
+        for(int i=0; i < 4; i++)
+        {
+            child.tile = createChild(node.tile, i);
+            this->nodes[key.getChild(i).getPacked()] = child;
+        }
+        node.split = true;
+        this->splitCount++;
+
+        command.type = TreeCommand::SPLIT;
+        command.key = key;
+        this->commands.push_back(command);
+    }
+    else
+    {
+        for(int i=0; i < 4; i++)
+            clearVisibleLeaves(key.getChild(i));
+    }
+}
+
+void PquadTree::clearVisibleLeaves(const TileKey &key)
+{
+    std::vector<TileKey> stack(1, key);
+    TileKey current;
+
+    while (!stack.empty())
+    {
+        current = stack.back();
+        stack.pop_back();
+
+        TileNode &node = getNode(current);
+        node.visibleLeaf = false;
+        if (node.split)
+        {
+            for(int i=0; i < 4; i++)
+                stack.push_back(current.getChild(i));
+        }
+    }
+}
+
+Ogre::Real PquadTree::horizonCutoff(HeightMap *node)
+{
+    float minHeight, maxHeight;
+    Ogre::Real angle, diff;
 
     /* Calculates comparison value for determining HeightMap visibility.
-     * Assumes horizon as a lowest plain which has highest possible feature as
+     * Assumes horizon as a lowest plain which has tile's highest feature as
      * background. First calculates angle from horizon to feature which is enough
      * to hide feature behind horizon. Then adds Pi/2 which is horizons
      * (or rather its normals) angle to the viewer. Finally, converts it to be
      * used as a comparator against dot product calculation. */
-    diff = (parameters->getRadius() - this->root->getAmplitude())
-            /(parameters->getRadius() + this->root->getAmplitude());
+    node->getBounds(minHeight, maxHeight);
+    diff = (1.0f + this->occluderHeight)/(1.0f + maxHeight);
+    if (diff > 1.0f)
+        diff = 1.0f;
     angle = Ogre::Math::ACos(diff).valueRadians();
-    this->dotCutoff = Ogre::Math::Cos(angle+Ogre::Math::HALF_PI);
-}
 
-PquadTree::~PquadTree()
-{
-    merge(this->root);
-    delete this->root;
+    return Ogre::Math::Cos(angle+Ogre::Math::HALF_PI);
 }
 
-void PquadTree::merge(HeightMap *node)
+void PquadTree::updateTree()
 {
-    if (node->getChild(0) != NULL)
+    Ogre::Vector3 corner[4];
+    double dProd, smallestAngle;
+    HeightMap *tile;
+    Ogre::Real threshold;
+    TileKey key;
+
+    this->traversal.clear();
+    this->traversal.push_back(this->rootKey);
+
+    while (!this->traversal.empty())
     {
+        key = this->traversal.back();
+        this->traversal.pop_back();
+
+        TileNode &node = getNode(key);
+        tile = node.tile;
+
+        tile->getCornerPosition(corner[0], corner[1], corner[2], corner[3]);
+
+        // Find corner with least tilt away from the viewer
+        smallestAngle = -1.0f;
         for(int i=0; i < 4; i++)
         {
-            merge(node->getChild(i));
+            // Scale corner to minimum height
+            corner[i] *= this->cornerScaling;
+
+            dProd = tiltTowards(this->viewer, corner[i]);
+            if (smallestAngle < dProd)
+                smallestAngle = dProd;
+        }
+
+        /* If HeightMap is not visible, just merge. */
+        if (horizonCutoff(tile) >= smallestAngle)
+        {
+            node.visibleLeaf = false;
+            merge(key);
+            continue;
+        }
+
+        /* Out of view, only a coarse tile is kept to turn back to. Subtree
+         * from earlier updates is left as it is for a while, in case the
+         * view returns soon. */
+        if (isCulled(tile))
+        {
+            if (node.split && !node.visibleLeaf
+                    && node.culledFrames < CULL_GRACE_FRAMES)
+                node.culledFrames++;
+            else
+                makeLeaf(key);
+            continue;
+        }
+        node.culledFrames = 0;
+
+        // Already split node stays split until error is clearly small
+        threshold = this->pixelTolerance;
+        if (node.split && !node.visibleLeaf)
+            threshold *= this->mergeRatio;
+
+        /* Error is known only for built tiles, so tree grows a level at a
+         * time as tiles come back from workers. Ocean is flat at sea level
+         * all the way down. Sub-divide. Node itself is unloaded in commit. */
+        if (tile->getBuildState() == HeightMap::BUILD_READY
+                && !tile->isOcean()
+                && screenSpaceError(tile, this->viewer) > threshold
+                && key.getLevel() < this->lod.maxDepth)
+        {
+            split(key);
+
+            for(int i=3; i >= 0; i--)
+                this->traversal.push_back(key.getChild(i));
+        }
+        /* Accurate enough, not built yet or deepest level reached. Tree from
+         * here on is deleted once the tile is ready. */
+        else
+            makeLeaf(key);
+    }
+}
+
+bool PquadTree::isCulled(HeightMap *node)
+{
+    Ogre::AxisAlignedBox box;
+
+    if (this->frustum.empty())
+        return false;
+
+    box = node->getBoundingBox();
+    for(unsigned int i=0; i < this->frustum.size(); i++)
+    {
+        if (this->frustum[i].getSide(box) == Ogre::Plane::NEGATIVE_SIDE)
+            return true;
+    }
+    return false;
+}
+
+Ogre::Real PquadTree::screenSpaceError(HeightMap *node, Ogre::Vector3 viewpoint)
+{
+    Ogre::AxisAlignedBox box = node->getBoundingBox();
+    double gap, distance = 0.0;
+
+    /* Distance to the nearest point of the box in double precision, float
+     * loses metres on big planets */
+    for(int i=0; i < 3; i++)
+    {
+        gap = 0.0;
+        if (viewpoint[i] < box.getMinimum()[i])
+            gap = static_cast<double>(box.getMinimum()[i]) - viewpoint[i];
+        else if (viewpoint[i] > box.getMaximum()[i])
+            gap = static_cast<double>(viewpoint[i]) - box.getMaximum()[i];
+        distance += gap*gap;
+    }
+    distance = std::sqrt(distance);
+
+    // Viewer inside the box sees any error
+    if (distance < 1e-3f)
+        return Ogre::Math::POS_INFINITY;
+
+    return node->getGeometricError()*this->errorScale/distance;
+}
+
+bool PquadTree::isShowable(const TileKey &key)
+{
+    std::vector<TileKey> stack(1, key);
+    TileKey current;
+
+    while (!stack.empty())
+    {
+        current = stack.back();
+        stack.pop_back();
 
-            if (node->getChild(i)->isLoaded() == true)
-                node->getChild(i)->unload(this->scNode, this->scene);
+        TileNode &node = getNode(current);
+        if (node.visibleLeaf)
+        {
+            if (!node.tile->isLoaded() && !node.tile->isInheriting())
+                return false;
+        }
+        // Leaf behind the horizon has nothing to draw
+        else if (node.split)
+        {
+            for(int i=0; i < 4; i++)
+                stack.push_back(current.getChild(i));
         }
-        node->deleteChildren();
     }
+    return true;
+}
+
+Ogre::Real PquadTree::priority(HeightMap *node)
+{
+    Ogre::Vector2 upperLeft, lowerRight;
+    Ogre::Real size, distance, urgency;
+
+    if (node->getBuildState() == HeightMap::BUILD_READY)
+        urgency = screenSpaceError(node, this->viewer);
+    else
+    {
+        /* Rough projected size: tile width over distance. Large and near
+         * tiles first. */
+        node->getTileRange(upperLeft, lowerRight);
+        size = Ogre::Math::Abs(lowerRight.x - upperLeft.x)*params->getRadius();
+        distance = (node->getCenterPosition() - this->viewer).length();
+        urgency = size/std::max(distance, 1e-3f);
+    }
+
+    /* Tile drawn with its parent's textures waits behind tiles that have
+     * nothing to draw, in the same order among themselves */
+    if (node->isInheriting())
+        return -1.0f/(1.0f + urgency);
+    return urgency;
 }
 
-void PquadTree::recursiveTest(HeightMap *node, Ogre::Vector3 viewer,
-                              float distanceTest, Ogre::uint16 level)
+void PquadTree::inheritChildren(const TileKey &key)
 {
-    Ogre::Vector3 dist, corner[4];
-    float distance, dProd, smallestAngle;
-    std::stringstream levelSS, runningSS;
-    std::string hName, ss_str;
+    HeightMap *parent = getNode(key).tile;
+
+    for(int i=0; i < 4; i++)
+    {
+        TileNode &child = getNode(key.getChild(i));
+        if (child.visibleLeaf && !child.split && !child.tile->isOcean()
+                && !child.tile->isLoaded() && !child.tile->isInheriting())
+            child.tile->inherit(parent, params->getRadius());
+    }
+}
+
+bool PquadTree::isInherited(const TileKey &key)
+{
+    for(int i=0; i < 4; i++)
+    {
+        if (getNode(key.getChild(i)).tile->isInheriting())
+            return true;
+    }
+    return false;
+}
+
+void PquadTree::requestBuild(HeightMap *node)
+{
+    if (node->getBuildState() == HeightMap::BUILD_EMPTY)
+    {
+        node->setQueued();
+        this->workers->submit(node, params->getRadius(), priority(node));
+    }
+}
+
+void PquadTree::requestTile(HeightMap *node, std::vector<UploadRequest> &uploads)
+{
+    UploadRequest request;
+
+    if (node->getBuildState() == HeightMap::BUILD_READY)
+    {
+        request.tile = node;
+        request.face = this;
+        request.priority = priority(node);
+        uploads.push_back(request);
+    }
+    else
+        requestBuild(node);
+}
+
+void PquadTree::uploadTile(HeightMap *node)
+{
+    node->upload(params->getRadius());
+}
+
+void PquadTree::prefetch(const std::vector<Ogre::Vector3> &path)
+{
+    std::vector<std::pair<Ogre::Real, TileKey> > candidates;
+    std::vector<Prefetch> finished;
+    std::vector<TileKey> leaves;
+    PrefetchTable::iterator it;
+
+    for(it = this->prefetching.begin(); it != this->prefetching.end(); )
+    {
+        if (it->second.tile->getBuildState() == HeightMap::BUILD_READY)
+        {
+            finished.push_back(it->second);
+            it = this->prefetching.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    /* Deeper levels are queued while the raster of their parent is at hand,
+     * cache may delete it */
+    for(unsigned int i=0; i < finished.size(); i++)
+    {
+        if (finished[i].depth > 1)
+            prefetchChildren(finished[i].tile, finished[i].depth - 1, path);
+        this->cache->insert(finished[i].tile);
+    }
+
+    if (this->prefetchDepth == 0 || path.empty())
+        return;
+
+    /* Leaves that will need most detail go first, the budget may not be
+     * enough for all */
+    collectVisibleLeaves(leaves);
+    for(unsigned int i=0; i < leaves.size(); i++)
+    {
+        TileNode &node = getNode(leaves[i]);
+        if (!node.split && node.tile->getBuildState() == HeightMap::BUILD_READY)
+            candidates.push_back(std::make_pair(predictedError(node.tile, path), leaves[i]));
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              std::greater<std::pair<Ogre::Real, TileKey> >());
 
-    /* Make individual name for every tile. qtree-name + _l<level> + _<running> */
-    /* FIXME: Tiny, but non-zero change, that 2 different entitys have same name. */
-    levelSS << level;
-    hName = this->name + "_l";
-    ss_str = levelSS.str();
-    runningSS << this->runningNumber;
-    ss_str = ss_str + "_" + runningSS.str();
-    hName = hName + ss_str;
+    for(unsigned int i=0; i < candidates.size(); i++)
+    {
+        if (this->prefetching.size() >= this->prefetchBudget)
+            break;
+        prefetchChildren(getNode(candidates[i].second).tile, this->prefetchDepth, path);
+    }
+}
 
-    this->runningNumber++;
+Ogre::Real PquadTree::predictedError(HeightMap *node, const std::vector<Ogre::Vector3> &path)
+{
+    Ogre::Real error = 0.0f;
 
-    dist = node->getCenterPosition() - viewer;
-    distance = dist.length();
+    for(unsigned int i=0; i < path.size(); i++)
+        error = std::max(error, screenSpaceError(node, path[i]));
+    return error;
+}
 
-    node->getCornerPosition(corner[0], corner[1], corner[2], corner[3]);
+void PquadTree::prefetchChildren(HeightMap *node, Ogre::uint8 depth,
+                                 const std::vector<Ogre::Vector3> &path)
+{
+    TileKey key = node->getKey(), childKey;
+    Ogre::Real distance;
+    Prefetch entry;
+
+    if (key.getLevel() >= this->lod.maxDepth || node->isOcean()
+            || predictedError(node, path) <= this->pixelTolerance)
+        return;
 
-    // Find corner with least tilt away from the viewer
-    smallestAngle = -1.0f;
     for(int i=0; i < 4; i++)
     {
-        // Scale corner to minimum height
-        corner[i] *= this->cornerScaling;
+        if (this->prefetching.size() >= this->prefetchBudget)
+            return;
+
+        childKey = key.getChild(i);
+        if (this->prefetching.count(childKey.getPacked()) > 0
+                || this->nodes.count(childKey.getPacked()) > 0
+                || this->cache->contains(childKey))
+            continue;
+
+        entry.tile = createChild(node, i);
+        entry.depth = depth;
+        this->prefetching[childKey.getPacked()] = entry;
+
+        /* Tiles needed now are never below -1, inheriting ones included. Of
+         * prefetches the ones closest to the path go first. */
+        distance = Ogre::Math::POS_INFINITY;
+        for(unsigned int j=0; j < path.size(); j++)
+            distance = std::min(distance, (entry.tile->getCenterPosition() - path[j]).length());
 
-        dist = viewer - corner[i];
-        corner[i].normalise();
-        dist.normalise();
-        dProd = dist.dotProduct(corner[i]);
-        if (smallestAngle < dProd)
-            smallestAngle = dProd;
+        entry.tile->setQueued();
+        this->workers->submit(entry.tile, params->getRadius(),
+                              PREFETCH_PRIORITY - distance);
     }
+}
+
+void PquadTree::setPrefetch(Ogre::uint8 depth, Ogre::uint32 maxTiles)
+{
+    this->prefetchDepth = depth;
+    this->prefetchBudget = maxTiles;
+}
+
+bool PquadTree::update(Ogre::Vector3 viewer, const std::vector<Ogre::Plane> &frustum)
+{
+    this->splitCount = 0;
+    this->mergeCount = 0;
+
+    if (!this->dirty && isSameView(viewer, frustum))
+        return false;
+
+    this->viewer = viewer;
+    this->frustum = frustum;
+    this->dirty = false;
+
+    /* Test for a subdivision in the quadtree. Depth-first. */
+    updateTree();
+    return true;
+}
 
-    /* If HeightMap is not visible, just merge and return. */
-    if (this->dotCutoff < smallestAngle)
+bool PquadTree::isSameView(Ogre::Vector3 viewer, const std::vector<Ogre::Plane> &frustum)
+{
+    if ((viewer - this->viewer).length() > this->updateTolerance
+            || frustum.size() != this->frustum.size())
+        return false;
+
+    // Turning moves far points of planes the most, so directions are compared closely
+    for(unsigned int i=0; i < frustum.size(); i++)
     {
-        /* If distance is bigger than test, render tile. */
-        if (distance > distanceTest)
+        if (frustum[i].normal.dotProduct(this->frustum[i].normal) < 1.0f - 1e-6f
+                || Ogre::Math::Abs(frustum[i].d - this->frustum[i].d) > this->updateTolerance)
+            return false;
+    }
+    return true;
+}
+
+void PquadTree::invalidate()
+{
+    this->dirty = true;
+}
+
+void PquadTree::setHysteresis(Ogre::Real mergeRatio)
+{
+    this->mergeRatio = mergeRatio;
+    this->dirty = true;
+}
+
+void PquadTree::setUpdateTolerance(Ogre::Real distance)
+{
+    this->updateTolerance = distance;
+}
+
+void PquadTree::getLodEvents(Ogre::uint32 &splits, Ogre::uint32 &merges)
+{
+    splits = this->splitCount;
+    merges = this->mergeCount;
+}
+
+void PquadTree::setErrorMetric(Ogre::Real viewportHeight, Ogre::Radian fovY,
+                               Ogre::Real pixelTolerance)
+{
+    Ogre::Real scale = viewportHeight/(2.0f*Ogre::Math::Tan(fovY.valueRadians()/2.0f));
+
+    // Called every frame, only a real change needs a new update
+    if (scale != this->errorScale || pixelTolerance != this->pixelTolerance)
+        this->dirty = true;
+
+    this->errorScale = scale;
+    this->pixelTolerance = pixelTolerance;
+}
+
+void PquadTree::applyCommands()
+{
+    PrefetchTable::iterator prefetched;
+    NodeTable::iterator it;
+    HeightMap *built;
+    TileKey childKey;
+
+    for(unsigned int i=0; i < this->commands.size(); i++)
+    {
+        TreeCommand &command = this->commands[i];
+
+        if (command.type == TreeCommand::RELEASE)
         {
+            releaseTile(command.tile);
+            continue;
+        }
+
+        /* New children are replaced with built ones from prefetching or
+         * cache, unless something was done to them already */
+        for(int j=0; j < 4; j++)
+        {
+            childKey = command.key.getChild(j);
+            it = this->nodes.find(childKey.getPacked());
+            if (it == this->nodes.end()
+                    || it->second.tile->getBuildState() != HeightMap::BUILD_EMPTY)
+                continue;
+
+            built = NULL;
+
+            /* Prefetch still waiting has too low a priority for a tile
+             * needed now, so it is built again */
+            prefetched = this->prefetching.find(childKey.getPacked());
+            if (prefetched != this->prefetching.end())
+            {
+                if (prefetched->second.tile->getBuildState() == HeightMap::BUILD_READY)
+                    built = prefetched->second.tile;
+                else
+                    prefetched->second.tile->cancel();
+                this->prefetching.erase(prefetched);
+            }
 
-            if (node->isLoaded() == false)
+            if (built == NULL)
+                built = this->cache->take(childKey);
+            // Built child may be refined further on the next update
+            if (built != NULL)
             {
-                node->load(this->scNode, this->scene, hName, params->getRadius());
+                delete it->second.tile;
+                it->second.tile = built;
+                this->dirty = true;
             }
-            /* Delete tree from here on */
-            merge(node);
         }
-        /* Sub-divide. */
-        else if (level < MAX_LEVEL)
+    }
+    this->commands.clear();
+}
+
+void PquadTree::commit(std::vector<UploadRequest> &uploads)
+{
+    std::vector<std::pair<TileKey, bool> > stack;
+    HeightMap *tile;
+    TileKey key;
+    bool hidden;
+
+    applyCommands();
+
+    stack.push_back(std::make_pair(this->rootKey, false));
+
+    while (!stack.empty())
+    {
+        key = stack.back().first;
+        hidden = stack.back().second;
+        stack.pop_back();
+
+        TileNode &node = getNode(key);
+        tile = node.tile;
+
+        /* Hidden subtree is covered by an ancestor, but its tiles are still
+         * requested and kept uploaded so that it can replace the ancestor. */
+        if (hidden)
+            tile->detach();
+
+        if (node.visibleLeaf)
         {
-            if (node->isLoaded() == true)
-                node->unload(scNode, scene);
+            if (tile->isLoaded())
+            {
+                merge(key);
+                if (!hidden)
+                    tile->attach(this->scNode);
+            }
+            else
+            {
+                requestTile(tile, uploads);
 
-            distanceTest /= 2.0f;
+                // Stand-in with parent's textures is drawn until then
+                if (!hidden && !node.split && tile->isInheriting())
+                    tile->attach(this->scNode);
 
-            level++;
+                // Children left over from before are drawn until then
+                if (hidden && node.split)
+                {
+                    for(int i=3; i >= 0; i--)
+                        stack.push_back(std::make_pair(key.getChild(i), true));
+                }
+            }
+        }
+        else if (node.split)
+        {
+            /* Children not built yet are drawn with this tile's textures */
+            if (!hidden && tile->isLoaded())
+                inheritChildren(key);
 
-            /* Create children if not done in previous frame */
-            if (node->getChild(0) == NULL)
-                node->createChildren();
+            /* Parent stays visible until all its children can be shown */
+            if (!hidden && (tile->isLoaded() || tile->isInheriting()) && !isShowable(key))
+            {
+                tile->attach(this->scNode);
+                hidden = true;
+            }
+            // Hidden but kept loaded for its textures
+            else if (tile->isLoaded() && isInherited(key))
+                tile->detach();
+            else if (tile->isLoaded() || tile->isInheriting())
+                tile->unload(this->scene);
 
-            for(int i=0; i < 4; i++)
+            for(int i=3; i >= 0; i--)
+                stack.push_back(std::make_pair(key.getChild(i), hidden));
+        }
+        /* Leaves behind the horizon left loaded from earlier frames are kept */
+    }
+
+    // Subtrees merged above
+    applyCommands();
+}
+
+void PquadTree::updateStitching()
+{
+    TileKey key, neighbour;
+    Ogre::uint8 mask;
+
+    this->traversal.clear();
+    this->traversal.push_back(this->rootKey);
+
+    while (!this->traversal.empty())
+    {
+        key = this->traversal.back();
+        this->traversal.pop_back();
+
+        TileNode &node = getNode(key);
+        if (node.tile->isAttached())
+        {
+            mask = 0;
+            for(int edge=0; edge < 4; edge++)
             {
-                recursiveTest(node->getChild(i), viewer, distanceTest, level);
+                if (findDrawn(this->faces, edgeProbe(node.tile, edge), neighbour)
+                        && neighbour.getLevel() < key.getLevel())
+                    mask |= 1 << edge;
+            }
+            node.tile->setStitchMask(mask);
+        }
+        else if (node.split)
+        {
+            for(int i=0; i < 4; i++)
+                this->traversal.push_back(key.getChild(i));
+        }
+    }
+}
+
+void PquadTree::collectVisibleLeaves(std::vector<TileKey> &leaves)
+{
+    for(NodeTable::iterator it = this->nodes.begin(); it != this->nodes.end(); ++it)
+    {
+        if (it->second.visibleLeaf)
+            leaves.push_back(TileKey(it->first));
+    }
+}
 
+void PquadTree::restrictNeighbours(const std::vector<PquadTree*> &faces)
+{
+    std::vector<TileKey> work;
+    TileKey leaf, neighbour, child;
+    PquadTree *face, *neighbourFace;
+    bool neighbourSplit;
+
+    for(unsigned int i=0; i < faces.size(); i++)
+        faces[i]->collectVisibleLeaves(work);
+
+    /* Splitting a neighbour may break restriction with its other neighbours,
+     * so new children go back to work list. Leaves behind the horizon are not
+     * split, cracks there can't be seen. Ocean leaves are split too, their
+     * edges have the vertices of full tiles and stitch the same way. */
+    while (!work.empty())
+    {
+        leaf = work.back();
+        work.pop_back();
+
+        face = faceOf(faces, leaf);
+        TileNode &leafNode = face->getNode(leaf);
+
+        // Split earlier by some other leaf
+        if (leafNode.visibleLeaf == false)
+            continue;
+
+        neighbourSplit = false;
+        for(int edge=0; edge < 4 && !neighbourSplit; edge++)
+        {
+            if (!findLeaf(faces, edgeProbe(leafNode.tile, edge), neighbour))
+                continue;
+
+            neighbourFace = faceOf(faces, neighbour);
+            if (neighbourFace->getNode(neighbour).visibleLeaf
+                    && neighbour.getLevel()+1 < leaf.getLevel())
+            {
+                neighbourFace->split(neighbour);
+                for(int i=0; i < 4; i++)
+                {
+                    child = neighbour.getChild(i);
+                    neighbourFace->getNode(child).visibleLeaf = true;
+                    work.push_back(child);
+                }
+                neighbourSplit = true;
             }
         }
-        /* MAX_LEVEL reached. */
-        else
+
+        // Neighbour may still be too coarse
+        if (neighbourSplit)
+            work.push_back(leaf);
+    }
+}
+
+Ogre::Vector3 PquadTree::edgeProbe(HeightMap *node, int edge)
+{
+    Ogre::Vector2 upperLeft, lowerRight, middle, point;
+
+    node->getTileRange(upperLeft, lowerRight);
+    middle = (upperLeft + lowerRight)/2.0f;
+    point = middle;
+
+    /* Quarter of a tile outside the edge lands inside any neighbour, whether
+     * it is finer, same size or coarser. */
+    switch(edge)
+    {
+    case Grid::neighbour_XP:
+        point.x = lowerRight.x + (lowerRight.x - middle.x)/2.0f;
+        break;
+    case Grid::neighbour_XM:
+        point.x = upperLeft.x + (upperLeft.x - middle.x)/2.0f;
+        break;
+    case Grid::neighbour_YP:
+        point.y = lowerRight.y + (lowerRight.y - middle.y)/2.0f;
+        break;
+    default:
+        point.y = upperLeft.y + (upperLeft.y - middle.y)/2.0f;
+        break;
+    }
+
+    /* Point past the face border is still on the face plane, so direction
+     * through it hits the neighbouring face. */
+    return Grid::faceToSphere(node->getMapping(), node->getOrientation(), point);
+}
+
+PquadTree *PquadTree::findFace(const std::vector<PquadTree*> &faces,
+                               Ogre::Vector3 direction, Ogre::Vector2 &facePoint)
+{
+    Ogre::Vector3 local, best;
+    PquadTree *face = NULL;
+
+    /* Face is the one whose normal is closest to the direction */
+    for(unsigned int i=0; i < faces.size(); i++)
+    {
+        local = faces[i]->orientation.Transpose()*direction;
+        if (face == NULL || local.y > best.y)
         {
-            if (node->isLoaded() == false)
-                node->load(this->scNode, this->scene, hName, params->getRadius());
+            face = faces[i];
+            best = local;
         }
     }
-    else
-        merge(node);
 
-    return;
+    if (face == NULL || best.y <= 0.0f)
+        return NULL;
+
+    facePoint = Ogre::Vector2(Grid::unwarp(face->lod.cubeMapping, best.x/best.y),
+                              Grid::unwarp(face->lod.cubeMapping, best.z/best.y));
+    return face;
 }
 
-void PquadTree::update(Ogre::Vector3 viewer)
+PquadTree *PquadTree::faceOf(const std::vector<PquadTree*> &faces,
+                              const TileKey &key)
 {
-    Ogre::Real subdivideDistance = 40.5f;
+    for(unsigned int i=0; i < faces.size(); i++)
+    {
+        if (faces[i]->rootKey.getFace() == key.getFace())
+            return faces[i];
+    }
 
-    /* Test for a subdivision in the quadtree. Depth-first. */
-    recursiveTest(this->root, viewer, subdivideDistance, 0);
+    assert(false);
+    return NULL;
+}
+
+Ogre::uint8 PquadTree::childContaining(HeightMap *tile, Ogre::Vector2 facePoint)
+{
+    Ogre::Vector2 upperLeft, lowerRight, middle;
+    bool right, lower;
+
+    tile->getTileRange(upperLeft, lowerRight);
+    middle = (upperLeft + lowerRight)/2.0f;
+
+    // Children are upper left, upper right, lower left and lower right
+    right = (facePoint.x - middle.x)*(lowerRight.x - upperLeft.x) > 0.0f;
+    lower = (facePoint.y - middle.y)*(lowerRight.y - upperLeft.y) > 0.0f;
+
+    return (lower ? 2 : 0) + (right ? 1 : 0);
+}
+
+bool PquadTree::findLeaf(const std::vector<PquadTree*> &faces,
+                         Ogre::Vector3 direction, TileKey &key)
+{
+    Ogre::Vector2 facePoint;
+    PquadTree *face;
+
+    face = findFace(faces, direction, facePoint);
+    if (face == NULL)
+        return false;
+
+    key = face->rootKey;
+    while (true)
+    {
+        TileNode &node = face->getNode(key);
+        if (node.visibleLeaf || !node.split)
+            return true;
+        key = key.getChild(childContaining(node.tile, facePoint));
+    }
+}
+
+bool PquadTree::findDrawn(const std::vector<PquadTree*> &faces,
+                          Ogre::Vector3 direction, TileKey &key)
+{
+    Ogre::Vector2 facePoint;
+    PquadTree *face;
+
+    face = findFace(faces, direction, facePoint);
+    if (face == NULL)
+        return false;
+
+    key = face->rootKey;
+    while (true)
+    {
+        TileNode &node = face->getNode(key);
+        if (node.tile->isAttached())
+            return true;
+        if (!node.split)
+            return false;
+        key = key.getChild(childContaining(node.tile, facePoint));
+    }
+}
+
+void PquadTree::setNeighbours(const std::vector<PquadTree*> &faces)
+{
+    this->faces = faces;
+}
+
+void PquadTree::setDiskCaches(const std::vector<TileDiskCache*> &perLevel)
+{
+    HeightMap *root = getNode(this->rootKey).tile;
+
+    this->diskCaches = perLevel;
+
+    // Root is built already, unless it was never drawn
+    if (root->getBuildState() == HeightMap::BUILD_EMPTY && !perLevel.empty())
+        root->setDiskCache(perLevel[0]);
+}
+
+void PquadTree::setBatcher(TileBatcher *batcher)
+{
+    HeightMap *root = getNode(this->rootKey).tile;
+
+    this->batcher = batcher;
+
+    // Root is loaded already, unless it was never drawn
+    if (!root->isLoaded())
+        root->setBatcher(batcher);
 }
 
 void PquadTree::setScene(Ogre::SceneManager *scene, Ogre::SceneNode *node)
@@ -23,38 +23,302 @@
 #ifndef PQUADTREE_H
 #define PQUADTREE_H
 
+#include <vector>
+#include <unordered_map>
+#include <OgrePlane.h>
 #include "HeightMap.h"
+#include "LodConfig.h"
 #include "ResourceParameter.h"
+#include "TileBatcher.h"
+#include "TileCache.h"
+#include "TileIndexPatterns.h"
+#include "TileResourcePool.h"
+#include "TileWorkerPool.h"
 
+/* Quadtree of HeightMap tiles covering one cube face. Updating is split in
+ * phases so that tree shape can be restricted across all faces before
+ * anything is loaded:
+ *  update()              decides tree shape from viewer position and frustum,
+ *  restrictNeighbours()  splits leaves until neighbours differ at most one level,
+ *  commit()              applies commands left by the phases above, requests
+ *                        tile builds from workers, attaches uploaded tiles and
+ *                        lists built tiles waiting for upload,
+ *  updateStitching()     stitches edges of drawn tiles next to coarser ones.
+ * Uploads are done by the caller in priority order within a per frame
+ * budget, see uploadTile(). Children of a split tile are drawn at once with
+ * stand-ins that use the tile's textures, see HeightMap::inherit. Where that
+ * is not possible, the tile stays drawn until all its children are
+ * uploaded.
+ *
+ * Nodes are kept in a hash table keyed by TileKey, with tile data out of
+ * line in HeightMaps. Children are found by their keys, and the tree is
+ * walked with an explicit stack. */
 class PquadTree
 {
 public:
-    PquadTree(const std::string name, Ogre::uint16 levelSize,
+    struct UploadRequest
+    {
+        HeightMap   *tile;
+        PquadTree   *face;
+        // Bigger is more urgent
+        Ogre::Real  priority;
+    };
+
+
+    /* Face index goes to tile keys. Depth and tile sizes come from lod,
+     * which must be validated. Ocean tiles use oceanPatterns. Tiles borrow
+     * hardware resources from pool. */
+    PquadTree(const std::string name, Ogre::uint8 faceIndex, const LodConfig &lod,
               Ogre::Matrix3 orientation, Ogre::Real seaHeight,
-              ResourceParameter *parameters);
+              ResourceParameter *parameters, TileIndexPatterns *patterns,
+              TileIndexPatterns *oceanPatterns,
+              TileWorkerPool *workers, TileCache *cache, TileResourcePool *pool,
+              bool compactVertices = false);
     ~PquadTree();
 
     /* Unload and delete the whole tree up to this node. Depth-first */
-    void merge(HeightMap *node);
+    void merge(const TileKey &key);
+
+    /* Set viewer position and decide which tiles should be drawn. Tiles
+     * outside all of the frustum planes, given in model space with normals
+     * pointing inside, are not refined. Empty frustum culls nothing.
+     * Returns false without doing anything if the view has moved less than
+     * update tolerance since the last update and nothing was invalidated.
+     * Touches only this face, no scene or cache, so faces can be updated in
+     * parallel. Releasing tiles and taking built ones from the cache are
+     * left as commands for commit. */
+    bool update(Ogre::Vector3 viewer, const std::vector<Ogre::Plane> &frustum);
+
+    /* Next update is done even if the view stays put. Needed when tiles
+     * finish building or get uploaded. */
+    void invalidate();
+
+    /* Tiles are split until their geometric error projects to at most
+     * pixelTolerance pixels on a viewport of given height and vertical
+     * field of view. */
+    void setErrorMetric(Ogre::Real viewportHeight, Ogre::Radian fovY,
+                        Ogre::Real pixelTolerance);
+
+    /* Split tile is merged only when its error drops below mergeRatio times
+     * pixel tolerance, so tiles near the limit don't flip every frame. */
+    void setHysteresis(Ogre::Real mergeRatio);
+
+    /* Viewer movement that is small enough to skip an update */
+    void setUpdateTolerance(Ogre::Real distance);
+
+    /* Nodes split and merged since the start of the last update, including
+     * restricting and commit that follow it */
+    void getLodEvents(Ogre::uint32 &splits, Ogre::uint32 &merges);
+
+    /* Builds tiles the viewer is about to need at the predicted positions
+     * in path, down to prefetch depth levels below current leaves. They
+     * are built after every tile needed now and then moved to the tile
+     * cache, where split finds them. Also collects finished prefetches, so
+     * run it every updated frame, with an empty path when not moving. */
+    void prefetch(const std::vector<Ogre::Vector3> &path);
+
+    /* Levels below a leaf built ahead, and how many tiles may be waiting
+     * for workers at once. Zero depth turns prefetching off. */
+    void setPrefetch(Ogre::uint8 depth, Ogre::uint32 maxTiles);
+
+    /* Split visible leaves of all faces until neighbouring leaves differ at
+     * most one level. Run after update() of every face. */
+    static void restrictNeighbours(const std::vector<PquadTree*> &faces);
 
-    /* Set viewer position and render face accordingly. */
-    void update(Ogre::Vector3 viewer);
+    /* Attach, detach and unload tiles according to the updated tree. Built
+     * tiles that should be drawn are appended to uploads. */
+    void commit(std::vector<UploadRequest> &uploads);
+
+    /* Create hardware buffers for a tile from an upload request. It is
+     * attached in next commit. Resources are named after the tile key. */
+    void uploadTile(HeightMap *node);
+
+    /* Stitch edges of drawn tiles next to a coarser drawn tile. Run after
+     * commit() of every face. */
+    void updateStitching();
+
+    /* Set all cube faces, this one included, for neighbour lookups. */
+    void setNeighbours(const std::vector<PquadTree*> &faces);
+
+    /* Leaf that should be drawn at given direction from the planet centre,
+     * searched from all faces. Returns false if direction hits no face. */
+    static bool findLeaf(const std::vector<PquadTree*> &faces,
+                         Ogre::Vector3 direction, TileKey &key);
+
+    /* Tile currently drawn at given direction. Returns false if there is
+     * none. */
+    static bool findDrawn(const std::vector<PquadTree*> &faces,
+                          Ogre::Vector3 direction, TileKey &key);
+
+    /* Tiles created from now on use the disk cache of their level for
+     * their height rasters. Levels share a cache when their rasters are of
+     * the same size. */
+    void setDiskCaches(const std::vector<TileDiskCache*> &perLevel);
+
+    /* Tiles created from now on are loaded into batches of batcher, see
+     * HeightMap::setBatcher */
+    void setBatcher(TileBatcher *batcher);
 
     /* Set scene and node once to avoid passing them as function parameters. */
     void setScene(Ogre::SceneManager *scene, Ogre::SceneNode *node);
 private:
-    HeightMap               *root;
+    /* Per node state of the tree. Node is split when its four children are
+     * in the table. */
+    struct TileNode
+    {
+        HeightMap       *tile;
+        bool            split;
+        // Passed visibility test in current update and should be drawn
+        bool            visibleLeaf;
+        // Consecutive updates outside the view frustum
+        Ogre::uint16    culledFrames;
+    };
+    typedef std::unordered_map<Ogre::uint64, TileNode> NodeTable;
+
+    /* Tile built ahead of need, outside the tree */
+    struct Prefetch
+    {
+        HeightMap       *tile;
+        // Levels left to build below this tile, itself included
+        Ogre::uint8     depth;
+    };
+    typedef std::unordered_map<Ogre::uint64, Prefetch> PrefetchTable;
+
+    /* Work on shared state left by update for commit */
+    struct TreeCommand
+    {
+        enum Type {
+            // Tile left the tree, see releaseTile
+            RELEASE,
+            // Node at key was split, its children may be found built
+            SPLIT
+        };
+
+        Type            type;
+        HeightMap       *tile;
+        TileKey         key;
+    };
+
+    NodeTable               nodes;
+    TileKey                 rootKey;
+    std::vector<TileKey>    traversal;
     std::string             name;
+    Ogre::Matrix3           orientation;
     Ogre::SceneManager      *scene;
     Ogre::SceneNode         *scNode;
     ResourceParameter       *params;
-    Ogre::uint32            runningNumber;
-    Ogre::Real              dotCutoff;
+    TileWorkerPool          *workers;
+    TileCache               *cache;
+    LodConfig               lod;
+    // By level, empty if there is no disk cache
+    std::vector<TileDiskCache*> diskCaches;
+    // NULL if tiles are loaded on their own
+    TileBatcher             *batcher;
+    float                   occluderHeight;
     Ogre::Real              cornerScaling;
+    std::vector<PquadTree*> faces;
+    Ogre::Vector3           viewer;
+    std::vector<Ogre::Plane> frustum;
+    bool                    dirty;
+    Ogre::Real              updateTolerance;
+    Ogre::Real              mergeRatio;
+    Ogre::uint32            splitCount;
+    Ogre::uint32            mergeCount;
+    PrefetchTable           prefetching;
+    std::vector<TreeCommand> commands;
+    Ogre::uint8             prefetchDepth;
+    Ogre::uint32            prefetchBudget;
+    // Pixels per world unit at distance one
+    Ogre::Real              errorScale;
+    Ogre::Real              pixelTolerance;
+
+    /* Subdivide face. Three states: match, subdivide, leaf reached. Only
+     * marks leaves to be drawn, loading is done in commit. */
+    void updateTree();
+
+    /* View differs from the last update by no more than update tolerance */
+    bool isSameView(Ogre::Vector3 viewer, const std::vector<Ogre::Plane> &frustum);
+
+    /* Bounding box of node is completely outside some frustum plane */
+    bool isCulled(HeightMap *node);
+
+    /* Geometric error of a built node projected to pixels from the nearest
+     * point of its bounding box, as seen from viewpoint */
+    Ogre::Real screenSpaceError(HeightMap *node, Ogre::Vector3 viewpoint);
+
+    /* Largest screen-space error of a built node along path */
+    Ogre::Real predictedError(HeightMap *node, const std::vector<Ogre::Vector3> &path);
+
+    /* Queue children of a built node that are not in the cache or being
+     * prefetched already, if they fit in the budget */
+    void prefetchChildren(HeightMap *node, Ogre::uint8 depth,
+                          const std::vector<Ogre::Vector3> &path);
+
+    /* Node must be in the table */
+    TileNode &getNode(const TileKey &key);
+
+    /* Tile is released in the next commit */
+    void retire(HeightMap *tile);
+
+    /* Move built tile to cache, or delete it. Tile still with a worker is
+     * left to be deleted when its worker is done. */
+    void releaseTile(HeightMap *tile);
+
+    /* Runs and clears commands in the order they were given */
+    void applyCommands();
+
+    /* Mark node to be drawn. Its subtree is merged when node is ready. */
+    void makeLeaf(const TileKey &key);
+
+    /* New child of a tile with texture size and disk cache of its level */
+    HeightMap *createChild(HeightMap *parent, Ogre::uint8 child);
+
+    /* Make node an inner node, creating children when needed. Caller
+     * decides which of the children are drawn. */
+    void split(const TileKey &key);
+
+    void clearVisibleLeaves(const TileKey &key);
+
+    /* All tiles under node that should be drawn are uploaded or have
+     * stand-ins */
+    bool isShowable(const TileKey &key);
+
+    /* Visible leaf children of a loaded node that are not built yet get
+     * stand-ins with the node's textures */
+    void inheritChildren(const TileKey &key);
+
+    /* Some child of a split node uses its textures */
+    bool isInherited(const TileKey &key);
+
+    /* Scheduling priority, bigger is more urgent. Screen-space error for
+     * built tiles, projected size for tiles still to be built. */
+    Ogre::Real priority(HeightMap *node);
+
+    void requestBuild(HeightMap *node);
+
+    /* Ask for upload if built, otherwise for build */
+    void requestTile(HeightMap *node, std::vector<UploadRequest> &uploads);
+
+    /* Dot product limit for the horizon test, from the highest point the
+     * node can have over the lowest terrain of the planet. */
+    Ogre::Real horizonCutoff(HeightMap *node);
+
+    void collectVisibleLeaves(std::vector<TileKey> &leaves);
+
+    /* Direction from the planet centre to a point just outside the given
+     * edge of the node, edge as in Grid::Grid_neighbour. */
+    static Ogre::Vector3 edgeProbe(HeightMap *node, int edge);
+
+    /* Face hit by direction and the point on it in face coordinates */
+    static PquadTree *findFace(const std::vector<PquadTree*> &faces,
+                               Ogre::Vector3 direction, Ogre::Vector2 &facePoint);
+
+    /* Face the key belongs to */
+    static PquadTree *faceOf(const std::vector<PquadTree*> &faces,
+                             const TileKey &key);
 
-    /* Recursively subdivide face. Three states: match, subdivide, leaf reached. */
-    void recursiveTest(HeightMap *node, Ogre::Vector3 viewer,
-                       float distanceTest, Ogre::uint16 level);
+    /* Index of the child of tile that contains facePoint */
+    static Ogre::uint8 childContaining(HeightMap *tile, Ogre::Vector2 facePoint);
 };
 
 #endif // PQUADTREE_H
@@ -33,6 +33,7 @@ ResourceParameter::ResourceParameter(void)
     /*waterFraction = 0.0;
         radius = 0.0;
         seed = 0;*/
+    translate[0] = translate[1] = translate[2] = 0.0f;
 }
 ResourceParameter::ResourceParameter(string newTerrainFirstColor,string newTerrainSecondColor,
                                      string newWaterFirstColor, string newWaterSecondColor,
@@ -49,7 +50,7 @@ ResourceParameter::ResourceParameter(string newTerrainFirstColor,string newTerra
     mountainSecondColor = newMountainSecondColor;
     waterFraction = newWaterFraction;
     radius = newRadius;
-    seed = newSeed;
+    setSeed(newSeed);
     setFrequencyAmplitude(newFrequencyAmplitude,' ');
     meshLocObjAmount = p_meshLocObjAmount;
 }
@@ -154,10 +155,35 @@ unsigned int ResourceParameter::getSeed(void)
 }
 void ResourceParameter::getRandomTranslate(float &x, float &y, float &z)
 {
-    srand(this->seed);
-    x = (float)((rand() % 1000)-500)/100.0f;
-    y = (float)((rand() % 1000)-500)/100.0f;
-    z = (float)((rand() % 1000)-500)/100.0f;
+    x = translate[0];
+    y = translate[1];
+    z = translate[2];
+}
+unsigned long long ResourceParameter::getTerrainHash(void)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    vector<unsigned char> bytes;
+    float x, y, z;
+
+    getRandomTranslate(x, y, z);
+    bytes.insert(bytes.end(), (unsigned char*)&x, (unsigned char*)&x + sizeof(x));
+    bytes.insert(bytes.end(), (unsigned char*)&y, (unsigned char*)&y + sizeof(y));
+    bytes.insert(bytes.end(), (unsigned char*)&z, (unsigned char*)&z + sizeof(z));
+    for(unsigned int i=0; i < frequency.size() && i < amplitude.size(); i++)
+    {
+        bytes.insert(bytes.end(), (unsigned char*)&frequency[i],
+                     (unsigned char*)&frequency[i] + sizeof(float));
+        bytes.insert(bytes.end(), (unsigned char*)&amplitude[i],
+                     (unsigned char*)&amplitude[i] + sizeof(float));
+    }
+
+    // FNV-1a
+    for(unsigned int i=0; i < bytes.size(); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
 vector <float>& ResourceParameter::getFrequency(void)
 {
@@ -218,6 +244,12 @@ void ResourceParameter::setRadius(float newRadius)
 void ResourceParameter::setSeed(unsigned int newSeed)
 {
     seed = newSeed;
+
+    /* Drawn once here, tiles read it from several threads and rand shares
+     * its state between them. */
+    srand(this->seed);
+    for(int i=0; i < 3; i++)
+        translate[i] = (float)((rand() % 1000)-500)/100.0f;
 }
 void ResourceParameter::setFrequency(float newFrequency)
 {
@@ -67,6 +67,8 @@ public:
     float getRadius(void);
     unsigned int getSeed(void);
     void getRandomTranslate(float &x, float &y, float &z);
+    // Hash of everything terrain heights depend on
+    unsigned long long getTerrainHash(void);
     std::vector <float>& getFrequency(void);
     std::vector <float>& getAmplitude(void);
     std::vector<std::pair <float, float> >& getFrequencyAmplitude(void);
@@ -99,6 +101,8 @@ private:
     float waterFraction;
     float radius;
     unsigned int seed;
+    // Noise offset drawn from seed
+    float translate[3];
     std::vector <float> frequency;
     std::vector <float> amplitude;
     std::vector <std::pair <float, float> > frequencyAmplitude;
@@ -0,0 +1,425 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include <assert.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <OgreEntity.h>
+#include <OgreHardwareBufferManager.h>
+#include <OgreHardwarePixelBuffer.h>
+#include <OgreMaterialManager.h>
+#include <OgreMeshManager.h>
+#include <OgreSceneManager.h>
+#include <OgreSceneNode.h>
+#include <OgreSubMesh.h>
+#include <OgreTextureManager.h>
+#include "TileBatcher.h"
+#include "HeightMap.h"
+#include "TileResourcePool.h"
+
+// Slots along a batch edge
+#define BATCH_SIDE 4
+#define BATCH_SLOTS (BATCH_SIDE*BATCH_SIDE)
+// Tile widths from the first tile that later tiles of a batch can be
+#define BATCH_REACH 8.0f
+
+Ogre::uint32 TileBatcher::nextName = 0;
+
+TileBatcher::TileBatcher(TileIndexPatterns *patterns, Ogre::uint32 maxIdle)
+{
+    this->patterns = patterns;
+    this->maxIdle = maxIdle;
+    this->scene = NULL;
+    this->node = NULL;
+
+    // Index buffer has room for every slot with its longest pattern
+    this->maxIndexCount = 0;
+    for(Ogre::uint8 mask=0; mask < 16; mask++)
+        this->maxIndexCount = std::max<Ogre::uint32>(this->maxIndexCount,
+                                                     patterns->getIndexes(mask).size());
+}
+
+TileBatcher::~TileBatcher()
+{
+    if (!this->slots.empty())
+        std::cerr << this->slots.size() << " batched tiles still in use" << std::endl;
+
+    for(BatchTable::iterator it = this->batches.begin(); it != this->batches.end(); ++it)
+    {
+        for(unsigned int i=0; i < it->second.size(); i++)
+            destroyBatch(it->second[i]);
+    }
+    for(unsigned int i=0; i < this->idle.size(); i++)
+        destroyBatch(this->idle[i]);
+}
+
+void TileBatcher::setScene(Ogre::SceneManager *scene, Ogre::SceneNode *node)
+{
+    this->scene = scene;
+    this->node = node;
+}
+
+TileKey TileBatcher::levelKey(const TileKey &tile)
+{
+    return TileKey(tile.getFace(), tile.getLevel(), 0, 0);
+}
+
+TileBatcher::Slot *TileBatcher::findSlot(HeightMap *tile)
+{
+    SlotTable::iterator it = this->slots.find(tile->getKey().getPacked());
+
+    if (it == this->slots.end() || it->second.batch->tiles[it->second.index] != tile)
+        return NULL;
+    return &it->second;
+}
+
+bool TileBatcher::insert(HeightMap *tile)
+{
+    Ogre::uint32 slotVertices = this->patterns->getSize()*this->patterns->getSize();
+    Ogre::HardwareVertexBufferSharedPtr vBuf;
+    Ogre::AxisAlignedBox box;
+    Batch *batch = NULL;
+    Slot slot;
+    float *pVertex;
+
+    if (this->node == NULL || this->slots.count(tile->getKey().getPacked()) > 0)
+        return false;
+
+    /* First batch of the level with room near enough to the tile */
+    std::vector<Batch*> &level = this->batches[levelKey(tile->getKey()).getPacked()];
+    for(unsigned int i=0; i < level.size() && batch == NULL; i++)
+    {
+        if (level[i]->tileCount < BATCH_SLOTS
+                && level[i]->normalMapped == tile->hasNormalMap()
+                && level[i]->textureResolution == tile->getTextureResolution()
+                && level[i]->origin.distance(tile->getTileOrigin()) <= level[i]->reach)
+            batch = level[i];
+    }
+    if (batch == NULL)
+    {
+        batch = takeBatch(tile);
+        level.push_back(batch);
+    }
+
+    slot.batch = batch;
+    slot.index = 0;
+    while (batch->tiles[slot.index] != NULL)
+        slot.index++;
+    this->slots[tile->getKey().getPacked()] = slot;
+
+    batch->tiles[slot.index] = tile;
+    batch->shown[slot.index] = false;
+    batch->stitchMasks[slot.index] = tile->getStitchMask();
+    batch->tileCount++;
+
+    /* Slot isn't drawn until it is shown, so its part of the buffer is not
+     * in use */
+    vBuf = batch->mesh->sharedVertexData->vertexBufferBinding->getBuffer(0);
+    pVertex = static_cast<float *>(vBuf->lock(slot.index*slotVertices*8*sizeof(float),
+                                              slotVertices*8*sizeof(float),
+                                              Ogre::HardwareBuffer::HBL_NO_OVERWRITE));
+    tile->fillVertices(pVertex, tile->getTileOrigin() - batch->origin,
+                       Ogre::Vector2(slot.index % BATCH_SIDE, slot.index / BATCH_SIDE)/BATCH_SIDE,
+                       1.0f/BATCH_SIDE);
+    vBuf->unlock();
+
+    fillAtlas(batch->texture, tile, slot.index, false);
+    if (batch->normalMapped)
+        fillAtlas(batch->normals, tile, slot.index, true);
+
+    // Bounds only grow until the batch is emptied
+    box = tile->getBoundingBox();
+    batch->bounds.merge(Ogre::AxisAlignedBox(box.getMinimum() - batch->origin,
+                                             box.getMaximum() - batch->origin));
+    batch->mesh->_setBounds(batch->bounds);
+
+    return true;
+}
+
+void TileBatcher::remove(HeightMap *tile)
+{
+    Slot *slot = findSlot(tile);
+    Batch *batch;
+
+    if (slot == NULL)
+        return;
+
+    batch = slot->batch;
+    if (batch->shown[slot->index])
+        batch->dirty = true;
+    batch->tiles[slot->index] = NULL;
+    batch->shown[slot->index] = false;
+    batch->tileCount--;
+    this->slots.erase(tile->getKey().getPacked());
+
+    if (batch->tileCount > 0)
+        return;
+
+    /* Empty batch leaves its level, and is kept for later tiles unless
+     * there are enough idle ones already */
+    BatchTable::iterator it = this->batches.find(levelKey(tile->getKey()).getPacked());
+    it->second.erase(std::find(it->second.begin(), it->second.end(), batch));
+    if (it->second.empty())
+        this->batches.erase(it);
+
+    if (batch->entity->isAttached())
+        batch->node->detachObject(batch->entity);
+    batch->mesh->getSubMesh(0)->indexData->indexCount = 0;
+    batch->dirty = false;
+
+    if (this->idle.size() < this->maxIdle)
+        this->idle.push_back(batch);
+    else
+        destroyBatch(batch);
+}
+
+void TileBatcher::show(HeightMap *tile, bool visible)
+{
+    Slot *slot = findSlot(tile);
+
+    assert(slot != NULL);
+
+    if (slot->batch->shown[slot->index] != visible)
+    {
+        slot->batch->shown[slot->index] = visible;
+        slot->batch->dirty = true;
+    }
+}
+
+void TileBatcher::setStitchMask(HeightMap *tile, Ogre::uint8 mask)
+{
+    Slot *slot = findSlot(tile);
+
+    assert(slot != NULL);
+
+    if (slot->batch->stitchMasks[slot->index] != mask)
+    {
+        slot->batch->stitchMasks[slot->index] = mask;
+        if (slot->batch->shown[slot->index])
+            slot->batch->dirty = true;
+    }
+}
+
+void TileBatcher::getTextures(HeightMap *tile, std::string &textureName,
+                              std::string &normalName, Ogre::Vector2 &uvOffset,
+                              Ogre::Real &uvScale)
+{
+    Slot *slot = findSlot(tile);
+
+    assert(slot != NULL);
+
+    textureName = slot->batch->texture->getName();
+    normalName = slot->batch->normalMapped ? slot->batch->normals->getName() : "";
+    uvOffset = Ogre::Vector2(slot->index % BATCH_SIDE, slot->index / BATCH_SIDE)/BATCH_SIDE;
+    uvScale = 1.0f/BATCH_SIDE;
+}
+
+void TileBatcher::update()
+{
+    Ogre::uint32 slot, count, base, slotVertices = this->patterns->getSize()*this->patterns->getSize();
+    Ogre::HardwareIndexBufferSharedPtr iBuf;
+    Ogre::IndexData *indexData;
+    Ogre::uint32 *pIndex;
+    Batch *batch;
+
+    for(BatchTable::iterator it = this->batches.begin(); it != this->batches.end(); ++it)
+    {
+        for(unsigned int i=0; i < it->second.size(); i++)
+        {
+            batch = it->second[i];
+            if (!batch->dirty)
+                continue;
+
+            indexData = batch->mesh->getSubMesh(0)->indexData;
+            iBuf = indexData->indexBuffer;
+            pIndex = static_cast<Ogre::uint32 *>(iBuf->lock(Ogre::HardwareBuffer::HBL_DISCARD));
+
+            count = 0;
+            for(slot=0; slot < BATCH_SLOTS; slot++)
+            {
+                if (!batch->shown[slot])
+                    continue;
+
+                const std::vector<Ogre::uint32> &indexes
+                        = this->patterns->getIndexes(batch->stitchMasks[slot]);
+                base = slot*slotVertices;
+                for(unsigned int j=0; j < indexes.size(); j++)
+                    pIndex[count++] = base + indexes[j];
+            }
+            iBuf->unlock();
+            indexData->indexCount = count;
+
+            // Empty index range would still be a draw call
+            if (count > 0 && !batch->entity->isAttached())
+                batch->node->attachObject(batch->entity);
+            else if (count == 0 && batch->entity->isAttached())
+                batch->node->detachObject(batch->entity);
+
+            batch->dirty = false;
+        }
+    }
+}
+
+Ogre::uint32 TileBatcher::getBatchCount()
+{
+    Ogre::uint32 count = 0;
+
+    for(BatchTable::iterator it = this->batches.begin(); it != this->batches.end(); ++it)
+        count += it->second.size();
+    return count;
+}
+
+TileBatcher::Batch *TileBatcher::takeBatch(HeightMap *tile)
+{
+    Ogre::AxisAlignedBox box = tile->getBoundingBox();
+    Batch *batch = NULL;
+
+    for(unsigned int i=0; i < this->idle.size(); i++)
+    {
+        if (this->idle[i]->normalMapped == tile->hasNormalMap()
+                && this->idle[i]->textureResolution == tile->getTextureResolution())
+        {
+            batch = this->idle[i];
+            this->idle.erase(this->idle.begin() + i);
+            break;
+        }
+    }
+    if (batch == NULL)
+        batch = createBatch(tile->getTextureResolution(), tile->hasNormalMap());
+
+    // Width of the tile from its bounds, height included
+    batch->origin = tile->getTileOrigin();
+    batch->reach = BATCH_REACH*box.getSize().length();
+    batch->bounds.setNull();
+    batch->node->setPosition(batch->origin);
+
+    return batch;
+}
+
+TileBatcher::Batch *TileBatcher::createBatch(Ogre::uint16 textureResolution, bool normalMapped)
+{
+    Ogre::uint32 slotVertices = this->patterns->getSize()*this->patterns->getSize();
+    Ogre::uint32 atlasSize = textureResolution*BATCH_SIDE;
+    std::string defGrpName = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
+    Ogre::HardwareVertexBufferSharedPtr vBuf;
+    Ogre::HardwareIndexBufferSharedPtr iBuf;
+    Ogre::VertexDeclaration *vertexDecl;
+    Ogre::SubMesh *subMesh;
+    Ogre::MaterialPtr material;
+    std::stringstream name;
+    Batch *batch = new Batch;
+
+    name << "TileBatch_" << nextName++;
+    batch->name = name.str();
+    batch->textureResolution = textureResolution;
+    batch->normalMapped = normalMapped;
+    for(int i=0; i < BATCH_SLOTS; i++)
+    {
+        batch->tiles[i] = NULL;
+        batch->shown[i] = false;
+        batch->stitchMasks[i] = 0;
+    }
+    batch->tileCount = 0;
+    batch->dirty = false;
+
+    // Same vertex layout as HeightMap::bufferMesh without compact vertices
+    batch->mesh = Ogre::MeshManager::getSingleton().createManual(batch->name + "_mesh", defGrpName);
+    subMesh = batch->mesh->createSubMesh();
+    batch->mesh->sharedVertexData = new Ogre::VertexData;
+    batch->mesh->sharedVertexData->vertexCount = BATCH_SLOTS*slotVertices;
+
+    vertexDecl = batch->mesh->sharedVertexData->vertexDeclaration;
+    vertexDecl->addElement(0, 0, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
+    vertexDecl->addElement(0, 4*3, Ogre::VET_FLOAT3, Ogre::VES_NORMAL);
+    vertexDecl->addElement(0, 4*6, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES);
+
+    vBuf = Ogre::HardwareBufferManager::getSingleton()
+           .createVertexBuffer(8*sizeof(float), BATCH_SLOTS*slotVertices,
+                               Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY, false);
+    batch->mesh->sharedVertexData->vertexBufferBinding->setBinding(0, vBuf);
+
+    // Slots are more than 16-bit indices can address
+    iBuf = Ogre::HardwareBufferManager::getSingleton()
+           .createIndexBuffer(Ogre::HardwareIndexBuffer::IT_32BIT, BATCH_SLOTS*this->maxIndexCount,
+                              Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY_DISCARDABLE, false);
+    subMesh->useSharedVertices = true;
+    subMesh->indexData->indexBuffer = iBuf;
+    subMesh->indexData->indexCount = 0;
+    subMesh->indexData->indexStart = 0;
+
+    batch->mesh->_setBounds(Ogre::AxisAlignedBox(Ogre::Vector3::ZERO, Ogre::Vector3::ZERO));
+    batch->mesh->load();
+
+    batch->texture = Ogre::TextureManager::getSingleton()
+            .createManual(batch->name + "_texture", defGrpName, Ogre::TEX_TYPE_2D,
+                          atlasSize, atlasSize, 0, Ogre::PF_R8G8B8, Ogre::TU_DYNAMIC);
+    if (normalMapped)
+        batch->normals = Ogre::TextureManager::getSingleton()
+                .createManual(batch->name + "_normals", defGrpName, Ogre::TEX_TYPE_2D,
+                              atlasSize, atlasSize, 0, Ogre::PF_R8G8B8, Ogre::TU_DYNAMIC);
+
+    material = TileResourcePool::createMaterial(batch->name + "_material", batch->name + "_texture",
+                                                normalMapped ? batch->name + "_normals" : "",
+                                                false);
+    subMesh->setMaterialName(material->getName());
+
+    batch->entity = this->scene->createEntity(batch->name, batch->name + "_mesh");
+    batch->entity->setMaterial(material);
+    batch->node = this->node->createChildSceneNode();
+
+    return batch;
+}
+
+void TileBatcher::destroyBatch(Batch *batch)
+{
+    if (batch->entity->isAttached())
+        batch->node->detachObject(batch->entity);
+    this->scene->destroySceneNode(batch->node);
+    this->scene->destroyEntity(batch->entity);
+
+    Ogre::MaterialManager::getSingleton().remove(batch->name + "_material");
+    batch->texture.setNull();
+    Ogre::TextureManager::getSingleton().remove(batch->name + "_texture");
+    if (batch->normalMapped)
+    {
+        batch->normals.setNull();
+        Ogre::TextureManager::getSingleton().remove(batch->name + "_normals");
+    }
+    batch->mesh.setNull();
+    Ogre::MeshManager::getSingleton().remove(batch->name + "_mesh");
+
+    delete batch;
+}
+
+void TileBatcher::fillAtlas(Ogre::TexturePtr atlas, HeightMap *tile, Ogre::uint32 slot,
+                            bool normals)
+{
+    Ogre::uint32 res = tile->getTextureResolution();
+    Ogre::uint32 left = (slot % BATCH_SIDE)*res, top = (slot / BATCH_SIDE)*res;
+    Ogre::HardwarePixelBufferSharedPtr pixelBuffer = atlas->getBuffer();
+
+    const Ogre::PixelBox &pixelBox = pixelBuffer->lock(Ogre::Box(left, top, left + res, top + res),
+                                                       Ogre::HardwareBuffer::HBL_NORMAL);
+    tile->fillTexture(static_cast<Ogre::uint8*>(pixelBox.data), pixelBox.rowPitch, normals);
+    pixelBuffer->unlock();
+}
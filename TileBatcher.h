@@ -0,0 +1,154 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef TILEBATCHER_H
+#define TILEBATCHER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <OgrePrerequisites.h>
+#include <OgreAxisAlignedBox.h>
+#include <OgreMesh.h>
+#include <OgreTexture.h>
+#include <OgreVector2.h>
+#include <OgreVector3.h>
+#include "TileIndexPatterns.h"
+#include "TileKey.h"
+
+class HeightMap;
+
+/* Loaded tiles drawn in batches instead of one entity each. A batch holds
+ * up to 16 tiles of one face and level, in slots that share one vertex
+ * buffer, one texture atlas (and normal map atlas) and one material, and
+ * the index buffer lists the shown slots with their stitch patterns. Tiles
+ * of a level in view lie in a ring around the viewer and usually fit one
+ * or two batches, so draw calls grow with faces and levels rather than
+ * with tiles.
+ *
+ * Vertices are floats relative to the origin of the first tile in the
+ * batch, and later tiles join only within a few tile widths of it. Atlas
+ * has no mipmaps, and texture coordinates stay on texel centres, so tiles
+ * don't bleed into each other. Emptied batches are kept for the next
+ * tiles of the same texture size, like TileResourcePool does for single
+ * tiles. */
+class TileBatcher
+{
+public:
+    /* Batched tiles have size*size vertices, like patterns. At most
+     * maxIdle empty batches are kept. */
+    TileBatcher(TileIndexPatterns *patterns, Ogre::uint32 maxIdle = 8);
+
+    /* Every tile has to be removed first */
+    ~TileBatcher();
+
+    /* Batches are made under node */
+    void setScene(Ogre::SceneManager *scene, Ogre::SceneNode *node);
+
+    /* Copies vertices and textures of a built tile to a free slot. Returns
+     * false if another tile of the same key has a slot, and the tile is
+     * loaded on its own. */
+    bool insert(HeightMap *tile);
+
+    /* Frees the slot, and keeps the batch for reuse once it is empty */
+    void remove(HeightMap *tile);
+
+    /* Tile is drawn from its slot or not */
+    void show(HeightMap *tile, bool visible);
+
+    void setStitchMask(HeightMap *tile, Ogre::uint8 mask);
+
+    /* Atlases holding the tile's textures and where the tile is in them, so
+     * that its children can inherit them. normalName is empty without a
+     * normal map. */
+    void getTextures(HeightMap *tile, std::string &textureName, std::string &normalName,
+                     Ogre::Vector2 &uvOffset, Ogre::Real &uvScale);
+
+    /* Rewrites index buffers of batches whose tiles were shown, hidden or
+     * stitched. Once per frame, after stitching. */
+    void update();
+
+    // Batches holding tiles, idle ones not counted
+    Ogre::uint32 getBatchCount();
+private:
+    struct Batch
+    {
+        std::string     name;
+        Ogre::Vector3   origin;
+        // Tiles further than this from origin go to another batch
+        Ogre::Real      reach;
+        Ogre::uint16    textureResolution;
+        bool            normalMapped;
+        HeightMap       *tiles[16];
+        bool            shown[16];
+        Ogre::uint8     stitchMasks[16];
+        Ogre::uint32    tileCount;
+        bool            dirty;
+        Ogre::AxisAlignedBox bounds;
+        Ogre::MeshPtr   mesh;
+        Ogre::TexturePtr texture;
+        // NULL pointer without normal maps
+        Ogre::TexturePtr normals;
+        Ogre::Entity    *entity;
+        Ogre::SceneNode *node;
+    };
+
+    struct Slot
+    {
+        Batch           *batch;
+        Ogre::uint32    index;
+    };
+
+    // Batches in use by face and level
+    typedef std::map<Ogre::uint64, std::vector<Batch*> > BatchTable;
+    // Slots by tile key
+    typedef std::map<Ogre::uint64, Slot> SlotTable;
+
+    TileIndexPatterns   *patterns;
+    Ogre::uint32        maxIndexCount;
+    Ogre::uint32        maxIdle;
+    Ogre::SceneManager  *scene;
+    Ogre::SceneNode     *node;
+    BatchTable          batches;
+    SlotTable           slots;
+    std::vector<Batch*> idle;
+    // Names are unique over all batchers, planets have one each
+    static Ogre::uint32 nextName;
+
+    /* Key of the face and level of the tile, x and y are zero */
+    static TileKey levelKey(const TileKey &tile);
+
+    /* Slot of the tile, NULL if it has none */
+    Slot *findSlot(HeightMap *tile);
+
+    /* Idle batch of the tile's texture size, or a new one, moved to the
+     * tile's origin */
+    Batch *takeBatch(HeightMap *tile);
+    Batch *createBatch(Ogre::uint16 textureResolution, bool normalMapped);
+    void destroyBatch(Batch *batch);
+
+    /* Copies texture or normal map of a tile to its slot in an atlas */
+    void fillAtlas(Ogre::TexturePtr atlas, HeightMap *tile, Ogre::uint32 slot,
+                   bool normals);
+};
+
+#endif // TILEBATCHER_H
@@ -0,0 +1,165 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include "TileCache.h"
+#include "HeightMap.h"
+
+TileCache::TileCache(Ogre::uint32 byteBudget, bool keepLoaded)
+{
+    this->scene = NULL;
+    this->budget = byteBudget;
+    this->size = 0;
+    this->keepLoaded = keepLoaded;
+    this->hits = 0;
+    this->misses = 0;
+}
+
+TileCache::~TileCache()
+{
+    clear();
+}
+
+void TileCache::setScene(Ogre::SceneManager *scene)
+{
+    this->scene = scene;
+}
+
+void TileCache::insert(HeightMap *tile)
+{
+    std::unordered_map<Ogre::uint64, TileList::iterator>::iterator old;
+
+    if (tile->isLoaded())
+    {
+        if (this->keepLoaded)
+            tile->detach();
+        else
+            tile->unload(this->scene);
+    }
+
+    // Same area stored twice, the older copy goes
+    old = this->index.find(tile->getKey().getPacked());
+    if (old != this->index.end())
+    {
+        this->size -= tileSize(*old->second);
+        destroy(*old->second);
+        this->tiles.erase(old->second);
+        this->index.erase(old);
+    }
+
+    this->tiles.push_front(tile);
+    this->index[tile->getKey().getPacked()] = this->tiles.begin();
+    this->size += tileSize(tile);
+
+    evict();
+}
+
+HeightMap *TileCache::take(const TileKey &key)
+{
+    std::unordered_map<Ogre::uint64, TileList::iterator>::iterator it;
+    HeightMap *tile;
+
+    it = this->index.find(key.getPacked());
+    if (it == this->index.end())
+    {
+        this->misses++;
+        return NULL;
+    }
+
+    tile = *it->second;
+    this->size -= tileSize(tile);
+    this->tiles.erase(it->second);
+    this->index.erase(it);
+    this->hits++;
+
+    return tile;
+}
+
+bool TileCache::contains(const TileKey &key)
+{
+    return this->index.find(key.getPacked()) != this->index.end();
+}
+
+void TileCache::setBudget(Ogre::uint32 byteBudget)
+{
+    this->budget = byteBudget;
+    evict();
+}
+
+void TileCache::setKeepLoaded(bool keepLoaded)
+{
+    this->keepLoaded = keepLoaded;
+}
+
+void TileCache::clear()
+{
+    for(TileList::iterator it = this->tiles.begin(); it != this->tiles.end(); ++it)
+        destroy(*it);
+
+    this->tiles.clear();
+    this->index.clear();
+    this->size = 0;
+}
+
+Ogre::uint32 TileCache::getHits()
+{
+    return this->hits;
+}
+
+Ogre::uint32 TileCache::getMisses()
+{
+    return this->misses;
+}
+
+Ogre::uint32 TileCache::getSize()
+{
+    return this->size;
+}
+
+Ogre::uint32 TileCache::tileSize(HeightMap *tile)
+{
+    Ogre::uint32 bytes = tile->getMemorySize();
+
+    if (tile->isLoaded())
+        bytes += tile->getUploadSize();
+    return bytes;
+}
+
+void TileCache::evict()
+{
+    HeightMap *tile;
+
+    while (this->size > this->budget && !this->tiles.empty())
+    {
+        tile = this->tiles.back();
+        this->size -= tileSize(tile);
+        this->index.erase(tile->getKey().getPacked());
+        this->tiles.pop_back();
+        destroy(tile);
+    }
+}
+
+void TileCache::destroy(HeightMap *tile)
+{
+    if (tile->isLoaded())
+        tile->unload(this->scene);
+    delete tile;
+}
@@ -0,0 +1,88 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <OgrePrerequisites.h>
+#include "TileKey.h"
+
+class HeightMap;
+
+/* Built tiles that left the quadtree, kept for a while in case the same
+ * area is subdivided again. Least recently stored tiles are deleted when
+ * the byte budget is exceeded. Tiles keep their hardware buffers only if
+ * keepLoaded is set, and those count towards the budget too. */
+class TileCache
+{
+public:
+    TileCache(Ogre::uint32 byteBudget = 32*1024*1024, bool keepLoaded = false);
+    ~TileCache();
+
+    /* Scene that loaded tiles are unloaded from */
+    void setScene(Ogre::SceneManager *scene);
+
+    /* Takes ownership of a built tile, detaching or unloading it */
+    void insert(HeightMap *tile);
+
+    /* Returns tile with given key and gives up its ownership, or NULL */
+    HeightMap *take(const TileKey &key);
+
+    /* Tile with given key is held. Not counted as a hit or miss. */
+    bool contains(const TileKey &key);
+
+    /* Smaller budget takes effect at once */
+    void setBudget(Ogre::uint32 byteBudget);
+    void setKeepLoaded(bool keepLoaded);
+
+    /* Unloads and deletes all tiles */
+    void clear();
+
+    Ogre::uint32 getHits();
+    Ogre::uint32 getMisses();
+
+    /* Bytes currently held */
+    Ogre::uint32 getSize();
+private:
+    typedef std::list<HeightMap*> TileList;
+
+    // Most recently inserted first
+    TileList                    tiles;
+    std::unordered_map<Ogre::uint64, TileList::iterator> index;
+    Ogre::SceneManager          *scene;
+    Ogre::uint32                budget;
+    Ogre::uint32                size;
+    bool                        keepLoaded;
+    Ogre::uint32                hits;
+    Ogre::uint32                misses;
+
+    Ogre::uint32 tileSize(HeightMap *tile);
+
+    /* Deletes least recent tiles until size fits in the budget */
+    void evict();
+
+    void destroy(HeightMap *tile);
+};
+
+#endif // TILECACHE_H
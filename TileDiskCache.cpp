@@ -0,0 +1,177 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include <iostream>
+#include <cstring>
+#include "TileDiskCache.h"
+
+#define PACK_MAGIC "PGTILES"
+#define PACK_VERSION 2
+
+TileDiskCache::TileDiskCache(const std::string &fileName, Ogre::uint64 terrainHash,
+                             Ogre::uint32 rasterSize, Ogre::uint32 tileVertices)
+{
+    this->terrainHash = terrainHash;
+    this->rasterSize = rasterSize;
+    this->tileVertices = tileVertices;
+    // Key and raster, padded to keep keys 8 byte aligned
+    this->recordSize = sizeof(Ogre::uint64) + rasterSize*rasterSize*sizeof(float);
+    this->recordSize = (this->recordSize + 7) & ~static_cast<Ogre::uint64>(7);
+    this->fileEnd = 0;
+
+    this->file.open(fileName.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (!this->file.is_open() || !readIndex())
+        startOver(fileName);
+
+    if (!this->file.is_open())
+        std::cerr << "Can't open tile cache " << fileName << std::endl;
+}
+
+TileDiskCache::~TileDiskCache()
+{
+    if (this->file.is_open())
+        this->file.close();
+}
+
+bool TileDiskCache::isOpen()
+{
+    return this->file.is_open();
+}
+
+bool TileDiskCache::readIndex()
+{
+    Header header;
+    Ogre::uint64 key, offset, records;
+
+    this->file.seekg(0, std::ios::end);
+    this->fileEnd = this->file.tellg();
+    this->file.seekg(0, std::ios::beg);
+
+    if (!this->file.read(reinterpret_cast<char*>(&header), sizeof(Header)))
+        return false;
+
+    if (strncmp(header.magic, PACK_MAGIC, sizeof(header.magic)) != 0
+            || header.version != PACK_VERSION
+            || header.rasterSize != this->rasterSize
+            || header.terrainHash != this->terrainHash
+            || header.tileVertices != this->tileVertices)
+        return false;
+
+    /* Record cut short by an interrupted write is left out, and written
+     * over by the next one. */
+    records = (this->fileEnd - sizeof(Header))/this->recordSize;
+    for(Ogre::uint64 i=0; i < records; i++)
+    {
+        offset = sizeof(Header) + i*this->recordSize;
+        this->file.seekg(offset, std::ios::beg);
+        if (!this->file.read(reinterpret_cast<char*>(&key), sizeof(key)))
+            return false;
+        this->index[key] = offset;
+    }
+    this->fileEnd = sizeof(Header) + records*this->recordSize;
+
+    return true;
+}
+
+void TileDiskCache::startOver(const std::string &fileName)
+{
+    Header header;
+
+    this->index.clear();
+    if (this->file.is_open())
+        this->file.close();
+
+    this->file.clear();
+    this->file.open(fileName.c_str(), std::ios::in | std::ios::out
+                    | std::ios::binary | std::ios::trunc);
+    if (!this->file.is_open())
+        return;
+
+    memset(&header, 0, sizeof(Header));
+    strncpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.rasterSize = this->rasterSize;
+    header.terrainHash = this->terrainHash;
+    header.tileVertices = this->tileVertices;
+
+    this->file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    this->fileEnd = sizeof(Header);
+}
+
+bool TileDiskCache::read(const TileKey &key, float *raster)
+{
+    std::unordered_map<Ogre::uint64, Ogre::uint64>::iterator it;
+    std::lock_guard<std::mutex> lock(this->fileMutex);
+
+    if (!this->file.is_open())
+        return false;
+
+    it = this->index.find(key.getPacked());
+    if (it == this->index.end())
+        return false;
+
+    this->file.clear();
+    this->file.seekg(it->second + sizeof(Ogre::uint64), std::ios::beg);
+    this->file.read(reinterpret_cast<char*>(raster),
+                    this->rasterSize*this->rasterSize*sizeof(float));
+    if (!this->file)
+    {
+        std::cerr << "Can't read tile " << key.getName() << " from cache" << std::endl;
+        this->index.erase(it);
+        return false;
+    }
+    return true;
+}
+
+void TileDiskCache::write(const TileKey &key, const float *raster)
+{
+    Ogre::uint64 packed = key.getPacked();
+    Ogre::uint64 padding = 0;
+    Ogre::uint64 dataSize = this->rasterSize*this->rasterSize*sizeof(float);
+    std::lock_guard<std::mutex> lock(this->fileMutex);
+
+    if (!this->file.is_open() || this->index.count(packed) > 0)
+        return;
+
+    this->file.clear();
+    this->file.seekp(this->fileEnd, std::ios::beg);
+    this->file.write(reinterpret_cast<const char*>(&packed), sizeof(packed));
+    this->file.write(reinterpret_cast<const char*>(raster), dataSize);
+    this->file.write(reinterpret_cast<const char*>(&padding),
+                     this->recordSize - sizeof(packed) - dataSize);
+    this->file.flush();
+    if (!this->file)
+    {
+        std::cerr << "Can't write tile " << key.getName() << " to cache" << std::endl;
+        return;
+    }
+
+    this->index[packed] = this->fileEnd;
+    this->fileEnd += this->recordSize;
+}
+
+Ogre::uint32 TileDiskCache::getTileCount()
+{
+    std::lock_guard<std::mutex> lock(this->fileMutex);
+
+    return this->index.size();
+}
@@ -0,0 +1,88 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef TILEDISKCACHE_H
+#define TILEDISKCACHE_H
+
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <OgrePrerequisites.h>
+#include "TileKey.h"
+
+/* Height rasters of tiles stored in a pack file between sessions, so that
+ * tiles seen before need no noise evaluation. Pack starts with a header
+ * holding the terrain hash, raster size and tile vertices, followed by fixed size records
+ * of a tile key and rasterSize*rasterSize floats in native byte order.
+ * Records are 8 byte aligned, so the file can be memory mapped as is.
+ * Reading and writing are safe from worker threads. */
+class TileDiskCache
+{
+public:
+    /* Opens or creates the pack. Pack made for other terrain parameters,
+     * raster size or tile vertices is started over. Raster spans the tile
+     * and one lattice interval of flange, so tileVertices decides its area
+     * even when the raster size is the same. */
+    TileDiskCache(const std::string &fileName, Ogre::uint64 terrainHash,
+                  Ogre::uint32 rasterSize, Ogre::uint32 tileVertices);
+    ~TileDiskCache();
+
+    /* False if the file could not be opened, then nothing is cached */
+    bool isOpen();
+
+    /* Reads a stored raster to a rasterSize*rasterSize array, rows one
+     * after another. Returns false if tile is not stored. */
+    bool read(const TileKey &key, float *raster);
+
+    /* Appends a raster, unless tile is stored already */
+    void write(const TileKey &key, const float *raster);
+
+    Ogre::uint32 getTileCount();
+private:
+    struct Header
+    {
+        char            magic[8];
+        Ogre::uint32    version;
+        Ogre::uint32    rasterSize;
+        Ogre::uint64    terrainHash;
+        Ogre::uint32    tileVertices;
+    };
+
+    std::fstream        file;
+    std::mutex          fileMutex;
+    // Record offsets in the file
+    std::unordered_map<Ogre::uint64, Ogre::uint64> index;
+    Ogre::uint64        terrainHash;
+    Ogre::uint32        rasterSize;
+    Ogre::uint32        tileVertices;
+    Ogre::uint64        recordSize;
+    Ogre::uint64        fileEnd;
+
+    /* Checks header and indexes complete records. Returns false if pack
+     * does not match. */
+    bool readIndex();
+
+    void startOver(const std::string &fileName);
+};
+
+#endif // TILEDISKCACHE_H
@@ -0,0 +1,208 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include <assert.h>
+#include <OgreHardwareBufferManager.h>
+#include "TileIndexPatterns.h"
+#include "Grid.h"
+
+TileIndexPatterns::TileIndexPatterns(Ogre::uint32 size, Ogre::uint32 step)
+{
+    assert(size >= 3 && (size-1)%2 == 0);
+    assert(step >= 1 && (size-1)%step == 0 && size-1 >= 2*step);
+
+    this->size = size;
+    this->step = step;
+
+    for(Ogre::uint8 i=0; i < 16; i++)
+        buildPattern(i);
+}
+
+TileIndexPatterns::~TileIndexPatterns()
+{
+    // Shared pointers release hardware buffers
+}
+
+void TileIndexPatterns::buildPattern(Ogre::uint8 edgeMask)
+{
+    std::vector<Ogre::uint32> &list = this->indexes[edgeMask];
+    Ogre::uint32 x, y;
+
+    /* Interior is a regular grid one step in from the edges */
+    for(x=step; x+2*step < size; x+=step)
+    {
+        for(y=step; y+2*step < size; y+=step)
+        {
+            addTriangle(list, x+step, y+step, x, y, x+step, y);
+            addTriangle(list, x, y, x+step, y+step, x, y+step);
+        }
+    }
+
+    zipEdge(list, Grid::neighbour_XP, (edgeMask & (1 << Grid::neighbour_XP)) != 0);
+    zipEdge(list, Grid::neighbour_XM, (edgeMask & (1 << Grid::neighbour_XM)) != 0);
+    zipEdge(list, Grid::neighbour_YP, (edgeMask & (1 << Grid::neighbour_YP)) != 0);
+    zipEdge(list, Grid::neighbour_YM, (edgeMask & (1 << Grid::neighbour_YM)) != 0);
+}
+
+void TileIndexPatterns::edgePoint(int edge, Ogre::uint32 t, Ogre::uint32 depth,
+                                  Ogre::uint32 &x, Ogre::uint32 &y)
+{
+    switch(edge)
+    {
+    case Grid::neighbour_XP:
+        x = size-1-depth;
+        y = t;
+        break;
+    case Grid::neighbour_XM:
+        x = depth;
+        y = t;
+        break;
+    case Grid::neighbour_YP:
+        x = t;
+        y = size-1-depth;
+        break;
+    default:
+        x = t;
+        y = depth;
+        break;
+    }
+}
+
+void TileIndexPatterns::zipEdge(std::vector<Ogre::uint32> &list, int edge,
+                                bool stitched)
+{
+    Ogre::uint32 i, j, edgeStep, eX0, eY0, eX1, eY1, iX0, iY0, iX1, iY1;
+
+    edgeStep = stitched ? 2 : 1;
+
+    /* Edge row runs from corner to corner, inner row from step to
+     * size-1-step. Walk both rows and always advance the one whose next
+     * vertex comes first, so corners are split along their diagonal. */
+    i = 0;
+    j = step;
+    while (i < size-1 || j < size-1-step)
+    {
+        edgePoint(edge, i, 0, eX0, eY0);
+        edgePoint(edge, j, step, iX0, iY0);
+
+        if (i < size-1 && (j == size-1-step || i+edgeStep < j+step))
+        {
+            edgePoint(edge, i+edgeStep, 0, eX1, eY1);
+            addTriangle(list, eX0, eY0, eX1, eY1, iX0, iY0);
+            i += edgeStep;
+        }
+        else
+        {
+            edgePoint(edge, j+step, step, iX1, iY1);
+            addTriangle(list, eX0, eY0, iX0, iY0, iX1, iY1);
+            j += step;
+        }
+    }
+}
+
+void TileIndexPatterns::addTriangle(std::vector<Ogre::uint32> &list,
+                                    Ogre::uint32 x0, Ogre::uint32 y0,
+                                    Ogre::uint32 x1, Ogre::uint32 y1,
+                                    Ogre::uint32 x2, Ogre::uint32 y2)
+{
+    Ogre::int32 area;
+
+    /* Positive area in lattice coordinates faces away from the planet centre */
+    area = (static_cast<Ogre::int32>(x1)-static_cast<Ogre::int32>(x0))
+           *(static_cast<Ogre::int32>(y2)-static_cast<Ogre::int32>(y0))
+           - (static_cast<Ogre::int32>(y1)-static_cast<Ogre::int32>(y0))
+           *(static_cast<Ogre::int32>(x2)-static_cast<Ogre::int32>(x0));
+
+    if (area == 0)
+        return;
+
+    list.push_back(x0*size+y0);
+    if (area > 0)
+    {
+        list.push_back(x1*size+y1);
+        list.push_back(x2*size+y2);
+    }
+    else
+    {
+        list.push_back(x2*size+y2);
+        list.push_back(x1*size+y1);
+    }
+}
+
+Ogre::HardwareIndexBufferSharedPtr TileIndexPatterns::getIndexBuffer(Ogre::uint8 edgeMask)
+{
+    assert(edgeMask < 16);
+
+    if (this->buffers[edgeMask].isNull())
+    {
+        const std::vector<Ogre::uint32> &list = this->indexes[edgeMask];
+        Ogre::HardwareIndexBufferSharedPtr iBuf;
+        Ogre::uint32 i;
+
+        /* Tiles are small enough for 16-bit indexes in practice */
+        if (size*size <= 65536)
+        {
+            iBuf = Ogre::HardwareBufferManager::getSingleton()
+                   .createIndexBuffer(Ogre::HardwareIndexBuffer::IT_16BIT, list.size(),
+                                      Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY, false);
+
+            Ogre::uint16 *pIdx;
+            pIdx = static_cast<Ogre::uint16 *>(iBuf->lock(Ogre::HardwareBuffer::HBL_DISCARD));
+            for(i=0; i < list.size(); i++)
+                pIdx[i] = static_cast<Ogre::uint16>(list[i]);
+            iBuf->unlock();
+        }
+        else
+        {
+            iBuf = Ogre::HardwareBufferManager::getSingleton()
+                   .createIndexBuffer(Ogre::HardwareIndexBuffer::IT_32BIT, list.size(),
+                                      Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY, false);
+
+            Ogre::uint32 *pIdx;
+            pIdx = static_cast<Ogre::uint32 *>(iBuf->lock(Ogre::HardwareBuffer::HBL_DISCARD));
+            for(i=0; i < list.size(); i++)
+                pIdx[i] = list[i];
+            iBuf->unlock();
+        }
+
+        this->buffers[edgeMask] = iBuf;
+    }
+
+    return this->buffers[edgeMask];
+}
+
+Ogre::uint32 TileIndexPatterns::getIndexCount(Ogre::uint8 edgeMask)
+{
+    assert(edgeMask < 16);
+    return this->indexes[edgeMask].size();
+}
+
+const std::vector<Ogre::uint32> &TileIndexPatterns::getIndexes(Ogre::uint8 edgeMask)
+{
+    assert(edgeMask < 16);
+    return this->indexes[edgeMask];
+}
+
+Ogre::uint32 TileIndexPatterns::getSize()
+{
+    return this->size;
+}
@@ -0,0 +1,78 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef TILEINDEXPATTERNS_H
+#define TILEINDEXPATTERNS_H
+
+#include <vector>
+#include <OgrePrerequisites.h>
+#include <OgreHardwareIndexBuffer.h>
+
+/* Index lists for a square tile lattice of size*size vertices, one for every
+ * combination of stitched edges. Edge bits are (1 << Grid::neighbour_XP) etc.
+ * A set bit means the neighbour across that edge is one level coarser, so
+ * every other vertex on the edge is skipped to match the neighbours edge.
+ * Inside the edges the lattice can be drawn coarser, using every step'th
+ * vertex, while edges keep every vertex and line up with full tiles.
+ * Vertex (x, y) has index x*size+y. Patterns are shared by all tiles. */
+class TileIndexPatterns
+{
+public:
+    /* Size-1 must be even for stitching to line up with the coarser tile,
+     * and a multiple of step, with at least two steps along the edge */
+    TileIndexPatterns(Ogre::uint32 size, Ogre::uint32 step = 1);
+    ~TileIndexPatterns();
+
+    /* Hardware index buffer for the pattern, created on first use */
+    Ogre::HardwareIndexBufferSharedPtr getIndexBuffer(Ogre::uint8 edgeMask);
+
+    Ogre::uint32 getIndexCount(Ogre::uint8 edgeMask);
+
+    const std::vector<Ogre::uint32> &getIndexes(Ogre::uint8 edgeMask);
+
+    Ogre::uint32 getSize();
+private:
+    Ogre::uint32                        size;
+    Ogre::uint32                        step;
+    std::vector<Ogre::uint32>           indexes[16];
+    Ogre::HardwareIndexBufferSharedPtr  buffers[16];
+
+    void buildPattern(Ogre::uint8 edgeMask);
+
+    /* Zips tile edge, given as Grid::Grid_neighbour, to the row of
+     * vertices one step inwards. Stitched edge uses only every other edge
+     * vertex. */
+    void zipEdge(std::vector<Ogre::uint32> &list, int edge, bool stitched);
+
+    /* Lattice coordinates of point t along the edge, depth rows inwards */
+    void edgePoint(int edge, Ogre::uint32 t, Ogre::uint32 depth,
+                   Ogre::uint32 &x, Ogre::uint32 &y);
+
+    /* Adds triangle facing outwards from the sphere, regardless of given
+     * vertex order. Degenerate triangles are dropped. */
+    void addTriangle(std::vector<Ogre::uint32> &list,
+                     Ogre::uint32 x0, Ogre::uint32 y0,
+                     Ogre::uint32 x1, Ogre::uint32 y1,
+                     Ogre::uint32 x2, Ogre::uint32 y2);
+};
+
+#endif // TILEINDEXPATTERNS_H
@@ -0,0 +1,145 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include <cstdio>
+#include "TileKey.h"
+
+#define FACE_SHIFT  61
+#define LEVEL_SHIFT 56
+#define MORTON_MASK 0x00FFFFFFFFFFFFFFULL
+#define LEVEL_MASK  0x1FULL
+#define FACE_MASK   0x7ULL
+
+TileKey::TileKey()
+{
+    this->packed = 0;
+}
+
+TileKey::TileKey(Ogre::uint8 face, Ogre::uint8 level, Ogre::uint32 x, Ogre::uint32 y)
+{
+    this->packed = (static_cast<Ogre::uint64>(face) & FACE_MASK) << FACE_SHIFT
+                 | (static_cast<Ogre::uint64>(level) & LEVEL_MASK) << LEVEL_SHIFT
+                 | ((spreadBits(x) | spreadBits(y) << 1) & MORTON_MASK);
+}
+
+TileKey::TileKey(Ogre::uint64 packed)
+{
+    this->packed = packed;
+}
+
+Ogre::uint8 TileKey::getFace() const
+{
+    return (this->packed >> FACE_SHIFT) & FACE_MASK;
+}
+
+Ogre::uint8 TileKey::getLevel() const
+{
+    return (this->packed >> LEVEL_SHIFT) & LEVEL_MASK;
+}
+
+Ogre::uint32 TileKey::getX() const
+{
+    return compactBits(this->packed & MORTON_MASK);
+}
+
+Ogre::uint32 TileKey::getY() const
+{
+    return compactBits((this->packed & MORTON_MASK) >> 1);
+}
+
+Ogre::uint64 TileKey::getPacked() const
+{
+    return this->packed;
+}
+
+TileKey TileKey::getChild(Ogre::uint8 child) const
+{
+    Ogre::uint64 morton = (this->packed & MORTON_MASK) << 2 | (child & 3);
+
+    return TileKey(((this->packed & ~MORTON_MASK) + (1ULL << LEVEL_SHIFT))
+                   | (morton & MORTON_MASK));
+}
+
+TileKey TileKey::getParent() const
+{
+    Ogre::uint64 morton = (this->packed & MORTON_MASK) >> 2;
+
+    if (getLevel() == 0)
+        return *this;
+
+    return TileKey(((this->packed & ~MORTON_MASK) - (1ULL << LEVEL_SHIFT)) | morton);
+}
+
+Ogre::uint8 TileKey::getChildIndex() const
+{
+    return this->packed & 3;
+}
+
+std::string TileKey::getName() const
+{
+    char name[48];
+
+    snprintf(name, sizeof(name), "f%u_l%u_%u_%u", getFace(), getLevel(),
+             getX(), getY());
+    return std::string(name);
+}
+
+bool TileKey::operator==(const TileKey &other) const
+{
+    return this->packed == other.packed;
+}
+
+bool TileKey::operator!=(const TileKey &other) const
+{
+    return this->packed != other.packed;
+}
+
+bool TileKey::operator<(const TileKey &other) const
+{
+    return this->packed < other.packed;
+}
+
+Ogre::uint64 TileKey::spreadBits(Ogre::uint32 value)
+{
+    Ogre::uint64 bits = value & 0x0FFFFFFF;
+
+    // Moves bit i to bit 2i
+    bits = (bits | bits << 16) & 0x0000FFFF0000FFFFULL;
+    bits = (bits | bits << 8)  & 0x00FF00FF00FF00FFULL;
+    bits = (bits | bits << 4)  & 0x0F0F0F0F0F0F0F0FULL;
+    bits = (bits | bits << 2)  & 0x3333333333333333ULL;
+    bits = (bits | bits << 1)  & 0x5555555555555555ULL;
+    return bits;
+}
+
+Ogre::uint32 TileKey::compactBits(Ogre::uint64 value)
+{
+    Ogre::uint64 bits = value & 0x5555555555555555ULL;
+
+    // Moves bit 2i to bit i
+    bits = (bits | bits >> 1)  & 0x3333333333333333ULL;
+    bits = (bits | bits >> 2)  & 0x0F0F0F0F0F0F0F0FULL;
+    bits = (bits | bits >> 4)  & 0x00FF00FF00FF00FFULL;
+    bits = (bits | bits >> 8)  & 0x0000FFFF0000FFFFULL;
+    bits = (bits | bits >> 16) & 0x00000000FFFFFFFFULL;
+    return static_cast<Ogre::uint32>(bits);
+}
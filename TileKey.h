@@ -0,0 +1,72 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef TILEKEY_H
+#define TILEKEY_H
+
+#include <string>
+#include <OgrePrerequisites.h>
+
+/* Identity of a quadtree tile packed in 64 bits: cube face (3 bits), level
+ * (5 bits), and x and y (28 bits each) counted in tiles of that level from
+ * the upper left corner of the face, x to the right and y downwards. Same
+ * tile gets the same key every time it is created.
+ *
+ * x and y are stored bit-interleaved (Morton code), x in even bits, so the
+ * lowest two bits are the child index within the parent and siblings have
+ * consecutive keys. */
+class TileKey
+{
+public:
+    TileKey();
+    TileKey(Ogre::uint8 face, Ogre::uint8 level, Ogre::uint32 x, Ogre::uint32 y);
+    explicit TileKey(Ogre::uint64 packed);
+
+    Ogre::uint8 getFace() const;
+    Ogre::uint8 getLevel() const;
+    Ogre::uint32 getX() const;
+    Ogre::uint32 getY() const;
+    Ogre::uint64 getPacked() const;
+
+    /* Children are upper left, upper right, lower left and lower right */
+    TileKey getChild(Ogre::uint8 child) const;
+
+    /* Parent of the root is the root itself */
+    TileKey getParent() const;
+
+    /* Which child of its parent this tile is, see getChild */
+    Ogre::uint8 getChildIndex() const;
+
+    /* Name for resources and logs, like "f2_l3_5_1" */
+    std::string getName() const;
+
+    bool operator==(const TileKey &other) const;
+    bool operator!=(const TileKey &other) const;
+    bool operator<(const TileKey &other) const;
+private:
+    Ogre::uint64    packed;
+
+    static Ogre::uint64 spreadBits(Ogre::uint32 value);
+    static Ogre::uint32 compactBits(Ogre::uint64 value);
+};
+
+#endif // TILEKEY_H
@@ -0,0 +1,245 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include <assert.h>
+#include <iostream>
+#include <sstream>
+#include <OgreEntity.h>
+#include <OgreHardwareBufferManager.h>
+#include <OgreMaterialManager.h>
+#include <OgreMeshManager.h>
+#include <OgreSceneManager.h>
+#include <OgreSubMesh.h>
+#include <OgreTechnique.h>
+#include <OgreTextureManager.h>
+#include "TileResourcePool.h"
+
+Ogre::uint32 TileResourcePool::nextName = 0;
+
+TileResourcePool::TileResourcePool(Ogre::uint32 maxIdle)
+{
+    this->scene = NULL;
+    this->maxIdle = maxIdle;
+    this->idleCount = 0;
+    this->borrowed = 0;
+    this->created = 0;
+}
+
+TileResourcePool::~TileResourcePool()
+{
+    if (this->borrowed > 0)
+        std::cerr << this->borrowed << " tile resources still borrowed" << std::endl;
+
+    for(IdleTable::iterator it = this->idle.begin(); it != this->idle.end(); ++it)
+    {
+        for(std::list<Resources*>::iterator res = it->second.begin();
+                res != it->second.end(); ++res)
+            destroy(*res);
+    }
+}
+
+void TileResourcePool::setScene(Ogre::SceneManager *scene)
+{
+    this->scene = scene;
+}
+
+TileResourcePool::Resources *TileResourcePool::acquire(Ogre::uint32 size, bool compactVertices,
+                                                       Ogre::uint16 textureResolution,
+                                                       bool normalMapped)
+{
+    Ogre::uint64 shape;
+    Resources *resources;
+
+    shape = size | static_cast<Ogre::uint64>(textureResolution) << 16
+            | static_cast<Ogre::uint64>(compactVertices) << 32
+            | static_cast<Ogre::uint64>(normalMapped) << 33;
+
+    std::list<Resources*> &free = this->idle[shape];
+    if (free.empty())
+    {
+        resources = create(size, compactVertices, textureResolution, normalMapped);
+        resources->shape = shape;
+    }
+    else
+    {
+        resources = free.front();
+        free.pop_front();
+        this->idleCount--;
+    }
+    this->borrowed++;
+
+    return resources;
+}
+
+void TileResourcePool::release(Resources *resources)
+{
+    assert(!resources->entity->isAttached());
+
+    this->borrowed--;
+
+    std::list<Resources*> &free = this->idle[resources->shape];
+    if (free.size() >= this->maxIdle)
+    {
+        destroy(resources);
+        return;
+    }
+
+    free.push_back(resources);
+    this->idleCount++;
+}
+
+Ogre::MaterialPtr TileResourcePool::createMaterial(const std::string &matName,
+                                                   const std::string &textureName,
+                                                   const std::string &normalName,
+                                                   bool compactVertices)
+{
+    std::string defGrpName = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
+    Ogre::MaterialPtr texMap;
+
+    if (!normalName.empty())
+    {
+        // Normal map is the second texture unit of both templates
+        texMap = Ogre::MaterialManager::getSingleton().getByName(
+                    compactVertices ? "PlanetTile/CompactNormalMapped" : "PlanetTile/NormalMapped");
+        texMap = texMap->clone(matName);
+        texMap->getTechnique(0)->getPass(0)->getTextureUnitState(0)->setTextureName(textureName);
+        texMap->getTechnique(0)->getPass(0)->getTextureUnitState(1)->setTextureName(normalName);
+    }
+    else if (compactVertices)
+    {
+        /* Fixed function can't decode compact vertices, so use shader based
+         * material as a template. */
+        texMap = Ogre::MaterialManager::getSingleton().getByName("PlanetTile/Compact");
+        texMap = texMap->clone(matName);
+        texMap->getTechnique(0)->getPass(0)->getTextureUnitState(0)->setTextureName(textureName);
+    }
+    else
+    {
+        /* FIXME: Should texMap and subMesh have a different (material) name?
+         * Same name works, but different name works as well. */
+        texMap = Ogre::MaterialManager::getSingleton().create(matName ,defGrpName);
+
+        texMap->getTechnique(0)->getPass(0)->createTextureUnitState(textureName);
+    }
+    texMap->getTechnique(0)->getPass(0)->setSceneBlending(Ogre::SBT_TRANSPARENT_ALPHA);
+
+    return texMap;
+}
+
+Ogre::uint32 TileResourcePool::getCreated()
+{
+    return this->created;
+}
+
+Ogre::uint32 TileResourcePool::getIdleCount()
+{
+    return this->idleCount;
+}
+
+TileResourcePool::Resources *TileResourcePool::create(Ogre::uint32 size, bool compactVertices,
+                                                      Ogre::uint16 textureResolution,
+                                                      bool normalMapped)
+{
+    std::string defGrpName = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
+    std::stringstream name;
+    Ogre::HardwareVertexBufferSharedPtr vBuf;
+    Ogre::VertexDeclaration *vertexDecl;
+    Ogre::SubMesh *subMesh;
+    Resources *resources = new Resources;
+
+    assert(this->scene != NULL);
+
+    name << "TilePool_" << nextName++;
+
+    resources->mesh = Ogre::MeshManager::getSingleton().createManual(name.str() + "_mesh", defGrpName);
+    subMesh = resources->mesh->createSubMesh();
+    subMesh->useSharedVertices = true;
+
+    resources->mesh->sharedVertexData = new Ogre::VertexData;
+    resources->mesh->sharedVertexData->vertexCount = size*size;
+    vertexDecl = resources->mesh->sharedVertexData->vertexDeclaration;
+
+    // Same layouts as HeightMap::bufferMesh fills
+    if (compactVertices)
+    {
+        vertexDecl->addElement(0, 0, Ogre::VET_SHORT4, Ogre::VES_POSITION);
+        vertexDecl->addElement(0, 2*4, Ogre::VET_SHORT2, Ogre::VES_TEXTURE_COORDINATES, 0);
+        vertexDecl->addElement(0, 2*6, Ogre::VET_SHORT2, Ogre::VES_TEXTURE_COORDINATES, 1);
+        vBuf = Ogre::HardwareBufferManager::getSingleton()
+               .createVertexBuffer(8*sizeof(Ogre::int16), size*size,
+                                   Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY_DISCARDABLE, false);
+    }
+    else
+    {
+        vertexDecl->addElement(0, 0, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
+        vertexDecl->addElement(0, 4*3, Ogre::VET_FLOAT3, Ogre::VES_NORMAL);
+        vertexDecl->addElement(0, 4*6, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES);
+        vBuf = Ogre::HardwareBufferManager::getSingleton()
+               .createVertexBuffer(8*sizeof(float), size*size,
+                                   Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY_DISCARDABLE, false);
+    }
+    resources->mesh->sharedVertexData->vertexBufferBinding->setBinding(0, vBuf);
+    resources->mesh->_setBounds(Ogre::AxisAlignedBox(Ogre::Vector3::ZERO, Ogre::Vector3::ZERO));
+    resources->mesh->load();
+
+    if (textureResolution > 0)
+    {
+        resources->texture = Ogre::TextureManager::getSingleton()
+                .createManual(name.str() + "_texture", defGrpName, Ogre::TEX_TYPE_2D,
+                              textureResolution, textureResolution, 0, Ogre::PF_R8G8B8,
+                              Ogre::TU_DYNAMIC_WRITE_ONLY_DISCARDABLE);
+        if (normalMapped)
+            resources->normals = Ogre::TextureManager::getSingleton()
+                    .createManual(name.str() + "_normals", defGrpName, Ogre::TEX_TYPE_2D,
+                                  textureResolution, textureResolution, 0, Ogre::PF_R8G8B8,
+                                  Ogre::TU_DYNAMIC_WRITE_ONLY_DISCARDABLE);
+    }
+
+    /* Borrower without textures of its own names the ones it uses, until
+     * then the units point to textures that don't exist */
+    resources->material = createMaterial(name.str() + "_material", name.str() + "_texture",
+                                         normalMapped ? name.str() + "_normals" : "",
+                                         compactVertices);
+    subMesh->setMaterialName(resources->material->getName());
+
+    resources->entity = this->scene->createEntity(name.str(), name.str() + "_mesh");
+    this->created++;
+
+    return resources;
+}
+
+void TileResourcePool::destroy(Resources *resources)
+{
+    std::string meshName = resources->mesh->getName();
+
+    this->scene->destroyEntity(resources->entity);
+
+    Ogre::MaterialManager::getSingleton().remove(resources->material->getName());
+    if (!resources->texture.isNull())
+        Ogre::TextureManager::getSingleton().remove(resources->texture->getName());
+    if (!resources->normals.isNull())
+        Ogre::TextureManager::getSingleton().remove(resources->normals->getName());
+    resources->mesh.setNull();
+    Ogre::MeshManager::getSingleton().remove(meshName);
+
+    delete resources;
+}
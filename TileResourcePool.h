@@ -0,0 +1,103 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef TILERESOURCEPOOL_H
+#define TILERESOURCEPOOL_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <OgrePrerequisites.h>
+#include <OgreMaterial.h>
+#include <OgreMesh.h>
+#include <OgreTexture.h>
+
+/* Hardware resources of loaded tiles, kept when tiles unload and handed to
+ * the next tile of the same shape. Contents are rewritten with HBL_DISCARD,
+ * so flying over the planet doesn't create or remove meshes, textures and
+ * materials once the pool has grown to what is in view. Render thread
+ * only. */
+class TileResourcePool
+{
+public:
+    /* What one tile draws with. Vertex buffer is the first binding of the
+     * mesh's shared vertex data, the tile sets index buffer and bounds.
+     * Material shows texture and normals, or has empty texture units if the
+     * tile has no textures of its own. */
+    struct Resources
+    {
+        Ogre::Entity        *entity;
+        Ogre::MeshPtr       mesh;
+        Ogre::MaterialPtr   material;
+        // NULL pointers when the tile has no textures of its own
+        Ogre::TexturePtr    texture;
+        Ogre::TexturePtr    normals;
+        Ogre::uint64        shape;
+    };
+
+    /* At most maxIdle released resources of each shape are kept */
+    TileResourcePool(Ogre::uint32 maxIdle = 64);
+
+    /* Destroys idle resources. Every borrowed one has to be released
+     * first. */
+    ~TileResourcePool();
+
+    void setScene(Ogre::SceneManager *scene);
+
+    /* Resources for a tile of size*size vertices, created if there are none
+     * idle. textureResolution 0 means no textures of its own. Normal mapped
+     * material has a second texture unit for normals. */
+    Resources *acquire(Ogre::uint32 size, bool compactVertices,
+                       Ogre::uint16 textureResolution, bool normalMapped);
+
+    /* Resources are detached from the scene by the tile. Contents are left
+     * as they are. */
+    void release(Resources *resources);
+
+    /* Material showing the given texture, shader based with compact
+     * vertices or a normal map. Empty normalName means no normal map. */
+    static Ogre::MaterialPtr createMaterial(const std::string &matName,
+                                            const std::string &textureName,
+                                            const std::string &normalName,
+                                            bool compactVertices);
+
+    // Resource sets made so far, to tell how often the pool misses
+    Ogre::uint32 getCreated();
+    Ogre::uint32 getIdleCount();
+private:
+    typedef std::map<Ogre::uint64, std::list<Resources*> > IdleTable;
+
+    Ogre::SceneManager  *scene;
+    IdleTable           idle;
+    Ogre::uint32        maxIdle;
+    Ogre::uint32        idleCount;
+    Ogre::uint32        borrowed;
+    Ogre::uint32        created;
+    // Names are unique over all pools, planets have one each
+    static Ogre::uint32 nextName;
+
+    Resources *create(Ogre::uint32 size, bool compactVertices,
+                      Ogre::uint16 textureResolution, bool normalMapped);
+    void destroy(Resources *resources);
+};
+
+#endif // TILERESOURCEPOOL_H
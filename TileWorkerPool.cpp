@@ -0,0 +1,155 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#include "TileWorkerPool.h"
+#include "HeightMap.h"
+
+TileWorkerPool::TileWorkerPool(unsigned int threadCount)
+{
+    this->stopping = false;
+    this->completed.store(NULL);
+
+    /* Leave one hardware thread for rendering */
+    if (threadCount == 0)
+    {
+        threadCount = std::thread::hardware_concurrency();
+        threadCount = threadCount > 1 ? threadCount-1 : 1;
+    }
+
+    for(unsigned int i=0; i < threadCount; i++)
+        threads.push_back(std::thread(&TileWorkerPool::workerLoop, this));
+}
+
+TileWorkerPool::~TileWorkerPool()
+{
+    Completed *item, *next;
+
+    stop();
+
+    // Tiles still in the stack belong to someone else, only free the links
+    item = completed.exchange(NULL);
+    while (item != NULL)
+    {
+        next = item->next;
+        delete item;
+        item = next;
+    }
+}
+
+void TileWorkerPool::submit(HeightMap *tile, float scalingFactor, float priority)
+{
+    Job job;
+
+    job.tile = tile;
+    job.scalingFactor = scalingFactor;
+    job.priority = priority;
+
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+
+        if (stopping)
+        {
+            pushCompleted(tile);
+            return;
+        }
+        jobs.push(job);
+    }
+    jobSignal.notify_one();
+}
+
+void TileWorkerPool::collectCompleted(std::vector<HeightMap*> &tiles)
+{
+    Completed *item, *next, *reversed = NULL;
+
+    item = completed.exchange(NULL, std::memory_order_acquire);
+
+    // Stack gives newest first
+    while (item != NULL)
+    {
+        next = item->next;
+        item->next = reversed;
+        reversed = item;
+        item = next;
+    }
+
+    while (reversed != NULL)
+    {
+        tiles.push_back(reversed->tile);
+        next = reversed->next;
+        delete reversed;
+        reversed = next;
+    }
+}
+
+void TileWorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stopping = true;
+    }
+    jobSignal.notify_all();
+
+    for(unsigned int i=0; i < threads.size(); i++)
+    {
+        if (threads[i].joinable())
+            threads[i].join();
+    }
+}
+
+void TileWorkerPool::workerLoop()
+{
+    Job job;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            while (jobs.empty() && !stopping)
+                jobSignal.wait(lock);
+
+            if (jobs.empty())
+                return;
+
+            job = jobs.top();
+            jobs.pop();
+        }
+
+        if (job.tile->isCancelled() == false)
+            job.tile->build(job.scalingFactor);
+
+        pushCompleted(job.tile);
+    }
+}
+
+void TileWorkerPool::pushCompleted(HeightMap *tile)
+{
+    Completed *item = new Completed;
+
+    item->tile = tile;
+    item->next = completed.load(std::memory_order_relaxed);
+
+    // Release makes tile data visible to the thread that collects it
+    while (!completed.compare_exchange_weak(item->next, item,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed))
+        ;
+}
@@ -0,0 +1,87 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Taneli Mikkonen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE. */
+
+#ifndef TILEWORKERPOOL_H
+#define TILEWORKERPOOL_H
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class HeightMap;
+
+/* Background threads that build tile data with HeightMap::build, most
+ * urgent first. Finished tiles are pushed to a lock-free stack, which the
+ * render thread empties with collectCompleted. Tiles cancelled before a
+ * worker reaches them are handed back unbuilt, so the render thread can
+ * delete them. */
+class TileWorkerPool
+{
+public:
+    /* Zero threads picks one less than there are hardware threads */
+    TileWorkerPool(unsigned int threadCount = 0);
+    ~TileWorkerPool();
+
+    /* Bigger priority is built first */
+    void submit(HeightMap *tile, float scalingFactor, float priority);
+
+    /* Appends finished tiles, oldest first. Render thread only. */
+    void collectCompleted(std::vector<HeightMap*> &tiles);
+
+    /* Runs remaining jobs and joins workers. Jobs submitted after stopping
+     * are completed without building. */
+    void stop();
+private:
+    struct Job
+    {
+        HeightMap   *tile;
+        float       scalingFactor;
+        float       priority;
+
+        bool operator<(const Job &other) const
+        {
+            return priority < other.priority;
+        }
+    };
+
+    struct Completed
+    {
+        HeightMap   *tile;
+        Completed   *next;
+    };
+
+    std::vector<std::thread>    threads;
+    std::priority_queue<Job>    jobs;
+    std::mutex                  jobMutex;
+    std::condition_variable     jobSignal;
+    bool                        stopping;
+    std::atomic<Completed*>     completed;
+
+    void workerLoop();
+
+    void pushCompleted(HeightMap *tile);
+};
+
+#endif // TILEWORKERPOOL_H
@@ -107,6 +107,10 @@ int initOgre::start(){
 	Scene = Root->createSceneManager(Ogre::ST_EXTERIOR_CLOSE);
 	RootSceneNode = Scene->getRootSceneNode();
 
+	/* Camera position is taken out of world transforms before they go to
+	 * the GPU, so tiles far from the scene origin don't jitter */
+	Scene->setCameraRelativeRendering(true);
+
 	if(OverlaySystem)
 		Scene->addRenderQueueListener(OverlaySystem);
 
@@ -0,0 +1,27 @@
+#version 120
+
+uniform sampler2D diffuseMap;
+
+varying vec2 texCoord;
+
+#ifdef NORMAL_MAP
+/* Normals in the planet's frame, which tile space shares, mapped from
+ * -1 - +1 to 0 - 1 */
+uniform sampler2D normalMap;
+uniform vec4 lightDiffuse;
+uniform vec4 ambient;
+
+varying vec3 lightDir;
+#else
+varying vec4 lightColour;
+#endif
+
+void main()
+{
+#ifdef NORMAL_MAP
+    vec3 normal = normalize(texture2D(normalMap, texCoord).xyz*2.0 - 1.0);
+    vec4 lightColour = ambient + lightDiffuse*max(dot(normal, normalize(lightDir)), 0.0);
+#endif
+    vec4 colour = texture2D(diffuseMap, texCoord)*lightColour;
+    gl_FragColor = vec4(colour.rgb, 1.0);
+}
@@ -0,0 +1,21 @@
+#version 120
+
+/* Planet tile with float vertices and a baked normal map. Lighting is done
+ * per fragment from the map, so vertex normals are not used. */
+
+attribute vec4 vertex;
+attribute vec4 uv0;
+
+uniform mat4 worldViewProj;
+uniform vec4 lightPosition;
+
+varying vec2 texCoord;
+varying vec3 lightDir;
+
+void main()
+{
+    gl_Position = worldViewProj * vertex;
+    texCoord = uv0.xy;
+    // Normalised per fragment, interpolating unit vectors would shorten them
+    lightDir = lightPosition.xyz - vertex.xyz*lightPosition.w;
+}
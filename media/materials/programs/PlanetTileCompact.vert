@@ -0,0 +1,56 @@
+#version 120
+
+/* Planet tile with compact vertices. Position is quantised to 16 bits and
+ * turned back to model space by node transform. Normal is octahedron-encoded
+ * in second texture coordinate set. Both texture coordinate sets are shorts
+ * scaled to range -32767 - +32767. */
+
+attribute vec4 vertex;
+attribute vec4 uv0;
+attribute vec4 uv1;
+
+uniform mat4 worldViewProj;
+uniform vec4 lightPosition;
+uniform vec4 lightDiffuse;
+uniform vec4 ambient;
+
+varying vec2 texCoord;
+#ifdef NORMAL_MAP
+varying vec3 lightDir;
+#else
+varying vec4 lightColour;
+#endif
+
+vec3 decodeOctahedron(vec2 e)
+{
+    vec3 n = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+
+    // Unfold lower hemisphere
+    if (n.z < 0.0)
+    {
+        vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        n.xy = (1.0 - abs(n.yx)) * signs;
+    }
+
+    return normalize(n);
+}
+
+void main()
+{
+    vec4 position = vec4(vertex.xyz, 1.0);
+
+    gl_Position = worldViewProj * position;
+    texCoord = uv0.xy / 32767.0;
+
+#ifdef NORMAL_MAP
+    // Normal comes from the map in fragment program
+    lightDir = lightPosition.xyz - position.xyz*lightPosition.w;
+#else
+    vec3 normal = decodeOctahedron(uv1.xy / 32767.0);
+
+    // Tile space has uniform scale, so directions are valid as they are
+    vec3 lightDir = normalize(lightPosition.xyz - position.xyz*lightPosition.w);
+
+    lightColour = ambient + lightDiffuse*max(dot(normal, lightDir), 0.0);
+#endif
+}